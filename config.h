@@ -5,13 +5,15 @@
 #include <stdint.h>
 #include <time.h>
 
-#define LOG_LENGTH 500 // log file size
+#include "logger.h"
+
+#define LOG_LENGTH 500 // longest formatted log line
 #define SQL_ATTEMPT 3 // number of attempts to try to join the SQL server
 #define CLEAR_DATABASE 1 // set to 1 to clear the database
 
-#define FIFO_NAME "logFifo"
 #define MAP_NAME "room_sensor.map"
 #define LOG_NAME "gateway.log"
+#define METRICS_NAME "gateway.metrics"
 
 typedef uint16_t sensor_id_t;
 typedef double sensor_value_t;
@@ -21,10 +23,8 @@ typedef struct {
   sensor_id_t id;
   sensor_value_t value;
   sensor_ts_t ts;
+  int64_t ingest_ns; // CLOCK_MONOTONIC time connmgr decoded it, 0 if it did not come off a socket
 } sensor_data_t;
 
 
-void log_write(char* log);
-
-
 #endif /* _CONFIG_H_ */
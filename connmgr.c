@@ -6,236 +6,662 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <poll.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#ifdef CONNMGR_USE_POLL
+    #include <poll.h>
+#else
+    #include <sys/epoll.h>
+#endif
 
-#include "lib/dplist.h"
-#include "lib/tcpsock.h"
 #include "config.h"
 #include "connmgr.h"
 #include "errmacros.h"
+#include "lib/pool.h"
+#include "metrics.h"
+
+// every worker has a pool of its own, and dplist takes one more
+#if CONNMGR_WORKERS + 1 > POOL_MAX
+    #error CONNMGR_WORKERS needs more pools than POOL_MAX allows
+#endif
 
+#ifdef CONNMGR_USE_POLL
 typedef struct pollfd poll_fd_t;
+#endif
 
-typedef struct var {
-    dplist_t* list;
-    tcpsock_t* server;
+typedef struct node node_t;
+
+// a reading arrives as id, value and timestamp back to back, and the
+// decoder remembers which field it is in and how much of it it has
+typedef enum {
+    DECODE_ID,
+    DECODE_VALUE,
+    DECODE_TS
+} decode_state_t;
+
+typedef struct deadline {
+    long expiry_ms;
+    node_t* node;
+} deadline_t;
+
+struct connmgr {
+    sbuffer_t* buffer;
+    pool_t* nodes; // connection nodes, reused instead of malloc'ed per connection
+    node_t** table;
+    int table_size;
+    int connections;
+    int server_fd;
+    int spare_fd; // held back so a connection can still be accepted and shed when out of descriptors
+    int throttled;        // sockets are not read while the buffer drains
+    long throttled_since;
+    long throttle_count;
+    long throttled_ms;
+#ifdef CONNMGR_USE_POLL
     poll_fd_t* poll_fd;
     int poll_max;
-} var_t;
-
-typedef struct node {
-    tcpsock_t* client_socket;
+#else
+    int epoll_fd;
+    struct epoll_event events[CONNMGR_MAX_EVENTS];
+#endif
+    int ready[CONNMGR_MAX_EVENTS];
+    int64_t read_ns; // when the bytes in rx were read
+    deadline_t* heap;
+    int heap_size;
+    int heap_capacity;
+    sensor_data_t batch[SBUFFER_BATCH_SIZE];
+    int batch_count;
+    unsigned char rx[CONNMGR_RECV_SIZE];
+};
+
+struct node {
     int socket_fd;
+    int heap_idx;
+    long deadline_ms;
     sensor_data_t data;
-} node_t;
+    decode_state_t state;
+    int field_len;
+    sensor_data_t pending;
+};
+
+static int open_listener(int port_number);
+static void handle_socket(connmgr_t* mgr, int ready);
+static void open_new_connection(connmgr_t* mgr);
+static int refuse_connection(connmgr_t* mgr);
+static void collect_data_from_socket(connmgr_t* mgr, int socket_fd);
+static void expire_connections(connmgr_t* mgr, long now);
+static int next_timeout(connmgr_t* mgr, long now);
+static void check_backpressure(connmgr_t* mgr);
+static void close_connection(connmgr_t* mgr, node_t* node);
+static void queue_data(connmgr_t* mgr, sensor_data_t* data);
+static void flush_data(connmgr_t* mgr);
+static void insert_into_table(connmgr_t* mgr, int socket_fd);
+static node_t* find_node_from_socket_fd(connmgr_t* mgr, int socket_fd);
+static int receive_data(connmgr_t* mgr, node_t* node);
+static int decode_data(connmgr_t* mgr, node_t* node, int bytes);
+static void timer_add(connmgr_t* mgr, node_t* node);
+static void timer_remove(connmgr_t* mgr, node_t* node);
+static void timer_sift_up(connmgr_t* mgr, int idx);
+static void timer_sift_down(connmgr_t* mgr, int idx);
+static void timer_swap(connmgr_t* mgr, int idx_1, int idx_2);
+static long get_time_ms();
+static void events_init(connmgr_t* mgr);
+static int events_wait(connmgr_t* mgr, int timeout_ms);
+static void events_add(connmgr_t* mgr, int socket_fd);
+static void events_remove(connmgr_t* mgr, int socket_fd);
+static void events_throttle(connmgr_t* mgr);
+static void events_free(connmgr_t* mgr);
+
+
+connmgr_t* connmgr_init(int port_number, sbuffer_t* buffer) {
+
+    connmgr_t* mgr = calloc(1, sizeof(connmgr_t));
+    ALLOC_ERR(mgr);
+
+    mgr->buffer = buffer;
+    mgr->nodes = pool_create(sizeof(node_t));
+    if (mgr->nodes == NULL && errno == ENOSPC)
+        ERROR_PRINTF("Unable to create a connection pool, all %d pools are in use\n", POOL_MAX);
+    ALLOC_ERR(mgr->nodes);
+    mgr->server_fd = open_listener(port_number);
+    mgr->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    SYS_ERR(mgr->spare_fd);
+
+    events_init(mgr);
+
+    return mgr;
+}
 
-static void handle_socket(sbuffer_t* buffer);
-static void open_new_connection();
-static void collect_data_from_socket(int* poll_idx, sbuffer_t* buffer);
-static void close_connection(node_t* node, int* poll_idx);
-static void insert_into_list(tcpsock_t* client, int* socket_fd);
-static node_t* find_node_from_poll_index(int* poll_idx);
-static int receive_data(tcpsock_t* client, sensor_data_t* data, int* bytes);
-static void node_free(void** node);
-static int node_compare(void* x, void* y);
-static var_t* get_var();
+void connmgr_listen(connmgr_t* mgr) {
 
+    while (1){
 
-void connmgr_listen(int port_number, sbuffer_t** buffer) {
+        int timeout_ms = mgr->throttled ? CONNMGR_THROTTLE_MS : next_timeout(mgr, get_time_ms());
+        int ready = events_wait(mgr, timeout_ms);
+        metrics_add(METRIC_WAKEUPS, 1);
+        if (ready == 0 && mgr->connections == 0)
+            break;
 
-    var_t* var = get_var();
-    int socket_fd;
+        handle_socket(mgr, ready);
+    }
+    printf("\nYour session has expired\n");
+}
 
-    TCP_ERR( tcp_passive_open(&var->server, port_number) );
-    TCP_ERR( tcp_get_sd(var->server, &socket_fd) );
+void connmgr_free(connmgr_t** mgr) {
 
-	var->poll_fd = calloc(2, sizeof(poll_fd_t));
-    ALLOC_ERR(var->poll_fd);
-    var->poll_fd->fd = socket_fd;
-    var->poll_fd->events = POLLIN;
-    var->poll_max = 1;
+    if ((*mgr)->throttle_count > 0)
+        LOG_PRINTF("The connection manager was throttled %ld times for %ld ms in total\n", (*mgr)->throttle_count, (*mgr)->throttled_ms);
 
-    var->list = dpl_create(NULL, &node_free, &node_compare);
+    for (int socket_fd = 0; socket_fd < (*mgr)->table_size; socket_fd++)
+        if ((*mgr)->table[socket_fd] != NULL)
+            close_connection(*mgr, (*mgr)->table[socket_fd]);
+    free((*mgr)->table);
+    free((*mgr)->heap);
+    pool_destroy(&(*mgr)->nodes);
 
-    while (1){
-        
-        int rc = poll(var->poll_fd, var->poll_max, TIMEOUT * 1000);
-        SYS_ERR(rc);
-        if (rc == 0 && dpl_size(var->list) == 0)
-            break;
+    events_free(*mgr);
+    SYS_ERR( close((*mgr)->server_fd) );
+    if ((*mgr)->spare_fd != -1)
+        SYS_ERR( close((*mgr)->spare_fd) );
+
+    free(*mgr);
+    *mgr = NULL;
+}
 
-        handle_socket(*buffer);
+// every worker binds its own listener to the same port, and the kernel
+// spreads incoming sensor connections across them
+int open_listener(int port_number) {
+
+    int option = 1;
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port_number),
+        .sin_addr.s_addr = htonl(INADDR_ANY)
+    };
+
+    int socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    SYS_ERR(socket_fd);
+    SYS_ERR( setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option)) );
+    SYS_ERR( setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &option, sizeof(option)) );
+    SYS_ERR( bind(socket_fd, (struct sockaddr*)&address, sizeof(address)) );
+    SYS_ERR( listen(socket_fd, SOMAXCONN) );
+
+    return socket_fd;
+}
+
+void handle_socket(connmgr_t* mgr, int ready) {
+
+    for (int i = 0; i < ready; i++) {
+        if (mgr->ready[i] == mgr->server_fd)
+            open_new_connection(mgr);
+        else
+            collect_data_from_socket(mgr, mgr->ready[i]);
     }
-    printf("\nYour session has expired\n");
+
+    if (!mgr->throttled)
+        expire_connections(mgr, get_time_ms());
+    flush_data(mgr);
+    check_backpressure(mgr);
 }
 
-void connmgr_free() {
+// the listener is non-blocking, so accept until the backlog is empty; another
+// worker may have raced us to a connection, which is not an error
+void open_new_connection(connmgr_t* mgr) {
+
+    while (1) {
+
+        int socket_fd = accept4(mgr->server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (socket_fd == -1) {
+            if ((errno == EMFILE || errno == ENFILE) && refuse_connection(mgr) == 0)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+                perror("Accept error");
+            return;
+        }
+
+        insert_into_table(mgr, socket_fd);
+        events_add(mgr, socket_fd);
+        metrics_add(METRIC_CONNECTIONS, 1);
+
+        DEBUG_PRINTF("Socket fd = %d has opened the socket\n", socket_fd);
+    }
+}
+
+// out of descriptors the pending connection stays in the backlog and the
+// level-triggered listener would wake us again at once, so the spare
+// descriptor is given up to accept it and close it straight away
+int refuse_connection(connmgr_t* mgr) {
+
+    if (mgr->spare_fd == -1) {
+        mgr->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        return -1;
+    }
+
+    SYS_ERR( close(mgr->spare_fd) );
+    int socket_fd = accept4(mgr->server_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (socket_fd != -1)
+        SYS_ERR( close(socket_fd) );
+    mgr->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
-    var_t* var = get_var();
+    if (socket_fd == -1)
+        return -1;
 
-	REALLOC_CHECK( var->poll_fd, sizeof(poll_fd_t) );
-    dpl_free(&var->list, true);
-	free(var->poll_fd);
-    TCP_ERR( tcp_close(&var->server) );
-    free(var);
+    LOG_PRINTF("Out of file descriptors, a new sensor connection was refused\n");
+    return 0;
 }
 
-void handle_socket(sbuffer_t* buffer) {
+void collect_data_from_socket(connmgr_t* mgr, int socket_fd) {
+
+    node_t* node = find_node_from_socket_fd(mgr, socket_fd);
+    if (node == NULL)
+        return;
 
-    var_t* var = get_var();
+    int bytes = receive_data(mgr, node);
+
+    if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
 
-    if (var->poll_fd[0].revents & POLLIN) {
-        open_new_connection();
+    if (bytes <= 0) {
+        close_connection(mgr, node);
         return;
     }
 
-    for (int poll_idx = 1; poll_idx < var->poll_max; poll_idx++) {
+    int records = decode_data(mgr, node, bytes);
+    if (records > 0) {
+        node->deadline_ms = get_time_ms() + TIMEOUT * 1000L;
+        metrics_add(METRIC_READINGS_RECEIVED, records);
+    }
+}
 
-        if (var->poll_fd[poll_idx].fd > 0) {
-            node_t* node = find_node_from_poll_index(&poll_idx);
-            if (time(NULL) - node->data.ts >= TIMEOUT) {
-                close_connection(node, &poll_idx);
-                continue;
-            }
+// heap keys are only refreshed lazily: new data just moves node->deadline_ms
+// forward, and a connection that reaches the top early is re-queued here
+void expire_connections(connmgr_t* mgr, long now) {
+
+    while (mgr->heap_size > 0 && mgr->heap[0].expiry_ms <= now) {
+        node_t* node = mgr->heap[0].node;
+        if (node->deadline_ms > now) {
+            mgr->heap[0].expiry_ms = node->deadline_ms;
+            timer_sift_down(mgr, 0);
+        } else {
+            close_connection(mgr, node);
+        }
+    }
+}
+
+int next_timeout(connmgr_t* mgr, long now) {
+
+    if (mgr->heap_size == 0)
+        return TIMEOUT * 1000;
+
+    long remaining = mgr->heap[0].expiry_ms - now;
+    return remaining > 0 ? (int)remaining : 0;
+}
+
+// above the high watermark the sensor sockets are taken out of the wait set,
+// so their receive windows fill up and TCP holds the sensors back; below the
+// low watermark they are read again, and the time spent not reading them is
+// added to every deadline so no sensor times out for the gateway's stall
+void check_backpressure(connmgr_t* mgr) {
+
+    size_t size = sbuffer_size(mgr->buffer);
+
+    if (!mgr->throttled && size >= SBUFFER_HIGH_WATERMARK) {
+        mgr->throttled = 1;
+        mgr->throttled_since = get_time_ms();
+        mgr->throttle_count++;
+        events_throttle(mgr);
+        metrics_add(METRIC_THROTTLES, 1);
+
+    } else if (mgr->throttled && size <= SBUFFER_LOW_WATERMARK) {
+        long throttled_ms = get_time_ms() - mgr->throttled_since;
+
+        for (int idx = 0; idx < mgr->heap_size; idx++) {
+            mgr->heap[idx].expiry_ms += throttled_ms;
+            mgr->heap[idx].node->deadline_ms += throttled_ms;
         }
+        mgr->throttled = 0;
+        mgr->throttled_ms += throttled_ms;
+        events_throttle(mgr);
+        metrics_add(METRIC_THROTTLED_MS, throttled_ms);
 
-        if (var->poll_fd[poll_idx].revents & POLLIN && dpl_size(var->list) > 0)
-            collect_data_from_socket(&poll_idx, buffer);
+        DEBUG_PRINTF("Connection manager resumed reading after %ld ms\n", throttled_ms);
     }
 }
 
-void open_new_connection() {
+void close_connection(connmgr_t* mgr, node_t* node) {
 
-    var_t* var = get_var();
-	tcpsock_t* client;
-	int socket_fd, poll_idx = 0;
+    LOG_PRINTF("The sensor node with %d has closed the connection\n", node->data.id);
+    DEBUG_PRINTF("Socket fd = %d has closed the socket\n", node->socket_fd);
 
-	TCP_ERR( tcp_wait_for_connection(var->server, &client) );
-	TCP_ERR( tcp_get_sd(client, &socket_fd) );
+    events_remove(mgr, node->socket_fd);
+    timer_remove(mgr, node);
+    mgr->table[node->socket_fd] = NULL;
+    mgr->connections--;
 
-	insert_into_list(client, &socket_fd);
+    SYS_ERR( close(node->socket_fd) );
+    pool_release(mgr->nodes, node);
+}
 
-	while (var->poll_fd[poll_idx].fd != -1 && poll_idx != var->poll_max)
-		poll_idx++;
+void queue_data(connmgr_t* mgr, sensor_data_t* data) {
 
-	if (poll_idx == var->poll_max) {
-		REALLOC_CHECK( var->poll_fd, (var->poll_max + 2) * sizeof(poll_fd_t) );
-		var->poll_fd[var->poll_max + 1].fd = 0;
-		(var->poll_max)++;
-	}
+    mgr->batch[mgr->batch_count++] = *data;
+    if (mgr->batch_count == SBUFFER_BATCH_SIZE)
+        flush_data(mgr);
+}
+
+void flush_data(connmgr_t* mgr) {
 
-	var->poll_fd[poll_idx].fd = socket_fd;
-	var->poll_fd[poll_idx].events = POLLIN;
+    if (mgr->batch_count == 0)
+        return;
 
-	DEBUG_PRINTF("Poll index %d with socket fd = %d has opened the socket\n", poll_idx, socket_fd);
+    SBUFFER_ERR( sbuffer_insert_batch(mgr->buffer, mgr->batch, mgr->batch_count) );
+    mgr->batch_count = 0;
 }
 
-void collect_data_from_socket(int* poll_idx, sbuffer_t* buffer) {
+// the kernel hands out the lowest free descriptor, so a table indexed by fd
+// stays dense and only grows with the peak number of open connections
+void insert_into_table(connmgr_t* mgr, int socket_fd) {
 
-    sensor_data_t data;
-	int data_size;
+    if (socket_fd >= mgr->table_size) {
+        int size = mgr->table_size > 0 ? mgr->table_size : 64;
+        while (size <= socket_fd)
+            size *= 2;
 
-	node_t* node = find_node_from_poll_index(poll_idx);
-    tcpsock_t* client = node->client_socket;
+        node_t** table = realloc(mgr->table, size * sizeof(node_t*));
+        ALLOC_ERR(table);
+        memset(table + mgr->table_size, 0, (size - mgr->table_size) * sizeof(node_t*));
+        mgr->table = table;
+        mgr->table_size = size;
+    }
+
+    node_t* node = pool_alloc(mgr->nodes);
+    ALLOC_ERR(node);
+    memset(node, 0, sizeof(node_t));
+    node->socket_fd = socket_fd;
+    node->deadline_ms = get_time_ms() + TIMEOUT * 1000L;
+
+    mgr->table[socket_fd] = node;
+    mgr->connections++;
+    timer_add(mgr, node);
+}
+
+node_t* find_node_from_socket_fd(connmgr_t* mgr, int socket_fd) {
 
-    int rc = receive_data(client, &data, &data_size);
+    if (socket_fd < 0 || socket_fd >= mgr->table_size)
+        return NULL;
+
+    return mgr->table[socket_fd];
+}
 
-    if (rc == TCP_NO_ERROR && data_size != 0) {
+// reads whatever the non-blocking socket has in a single recv, returns the
+// number of bytes read, 0 when the peer closed or -1 with errno set
+int receive_data(connmgr_t* mgr, node_t* node) {
+
+    int bytes = recv(node->socket_fd, mgr->rx, CONNMGR_RECV_SIZE, 0);
+    mgr->read_ns = metrics_now_ns();
+    return bytes;
+}
+
+// feeds the bytes just read through the connection's decoder, which picks up
+// a half-received field where the previous read left it, returns the
+// number of complete readings decoded
+int decode_data(connmgr_t* mgr, node_t* node, int bytes) {
+
+    unsigned char* input = mgr->rx;
+    int records = 0;
+
+    while (bytes > 0) {
+
+        unsigned char* field;
+        int field_size;
+
+        switch (node->state) {
+            case DECODE_ID:
+                field = (unsigned char*)&node->pending.id;
+                field_size = sizeof(node->pending.id);
+                break;
+            case DECODE_VALUE:
+                field = (unsigned char*)&node->pending.value;
+                field_size = sizeof(node->pending.value);
+                break;
+            default:
+                field = (unsigned char*)&node->pending.ts;
+                field_size = sizeof(node->pending.ts);
+                break;
+        }
+
+        int chunk = field_size - node->field_len;
+        if (chunk > bytes)
+            chunk = bytes;
+
+        memcpy(field + node->field_len, input, chunk);
+        node->field_len += chunk;
+        input += chunk;
+        bytes -= chunk;
+
+        if (node->field_len < field_size)
+            break;
+
+        node->field_len = 0;
+        if (node->state != DECODE_TS) {
+            node->state++;
+            continue;
+        }
+        node->state = DECODE_ID;
+        node->pending.ingest_ns = mgr->read_ns;
+        records++;
 
         if (node->data.id == 0)
-            LOG_PRINTF("A sensor node with %d has opened a new connection\n", data.id);
+            LOG_PRINTF("A sensor node with %d has opened a new connection\n", node->pending.id);
 
-        node->data.id = data.id;
-        node->data.value = data.value;
-        node->data.ts = data.ts;
+        node->data = node->pending;
 
-        printf("\tSensor id = %" PRIu16 "\tTemperature = %g\tTimestamp = %ld\n", data.id, data.value, (long int)data.ts);
+        DEBUG_PRINTF("Sensor id = %" PRIu16 "\tTemperature = %g\tTimestamp = %ld\n", node->data.id, node->data.value, (long int)node->data.ts);
 
-        sbuffer_insert(buffer, &data);
+        queue_data(mgr, &node->pending);
     }
-    else if (rc == TCP_CONNECTION_CLOSED)
-		close_connection(node, poll_idx);
-    else
-		TCP_ERR(rc);
+
+    return records;
 }
 
-void close_connection(node_t* node, int* poll_idx) {
+void timer_add(connmgr_t* mgr, node_t* node) {
 
-    var_t* var = get_var();
+    if (mgr->heap_size == mgr->heap_capacity) {
+        mgr->heap_capacity = mgr->heap_capacity > 0 ? mgr->heap_capacity * 2 : 64;
+        deadline_t* heap = realloc(mgr->heap, mgr->heap_capacity * sizeof(deadline_t));
+        ALLOC_ERR(heap);
+        mgr->heap = heap;
+    }
 
-    LOG_PRINTF("The sensor node with %d has closed the connection\n", node->data.id);
-    DEBUG_PRINTF("Poll index %d with socket fd = %d has closed the socket\n", *poll_idx, node->socket_fd);
+    node->heap_idx = mgr->heap_size++;
+    mgr->heap[node->heap_idx].expiry_ms = node->deadline_ms;
+    mgr->heap[node->heap_idx].node = node;
+    timer_sift_up(mgr, node->heap_idx);
+}
+
+void timer_remove(connmgr_t* mgr, node_t* node) {
 
-	TCP_ERR( tcp_close( &(node->client_socket) ) );
-	dpl_remove_at_index(var->list, dpl_get_index_of_element(var->list, node), true);
+    int idx = node->heap_idx;
 
-	var->poll_fd[*poll_idx].fd = -1;
-	if (*poll_idx == (var->poll_max) - 1)
-		(var->poll_max)--;
+    timer_swap(mgr, idx, --mgr->heap_size);
+    if (idx == mgr->heap_size)
+        return;
 
+    timer_sift_up(mgr, idx);
+    timer_sift_down(mgr, idx);
 }
 
-void insert_into_list(tcpsock_t* client, int* socket_fd) {
+void timer_sift_up(connmgr_t* mgr, int idx) {
+
+    while (idx > 0 && mgr->heap[(idx - 1) / 2].expiry_ms > mgr->heap[idx].expiry_ms) {
+        timer_swap(mgr, idx, (idx - 1) / 2);
+        idx = (idx - 1) / 2;
+    }
+}
 
-    var_t* var = get_var();
+void timer_sift_down(connmgr_t* mgr, int idx) {
+
+    while (1) {
+        int min = idx, left = 2 * idx + 1, right = 2 * idx + 2;
+        if (left < mgr->heap_size && mgr->heap[left].expiry_ms < mgr->heap[min].expiry_ms)
+            min = left;
+        if (right < mgr->heap_size && mgr->heap[right].expiry_ms < mgr->heap[min].expiry_ms)
+            min = right;
+        if (min == idx)
+            return;
+        timer_swap(mgr, idx, min);
+        idx = min;
+    }
+}
 
-	node_t* node = calloc(1, sizeof(node_t));
-    ALLOC_ERR(node);
-	node->client_socket = client;
-	node->socket_fd = *socket_fd;
-    node->data.ts = time(NULL);
+void timer_swap(connmgr_t* mgr, int idx_1, int idx_2) {
 
-	dpl_insert_at_index(var->list, node, -1, false);
+    deadline_t dummy = mgr->heap[idx_1];
 
+    mgr->heap[idx_1] = mgr->heap[idx_2];
+    mgr->heap[idx_2] = dummy;
+    mgr->heap[idx_1].node->heap_idx = idx_1;
+    mgr->heap[idx_2].node->heap_idx = idx_2;
 }
 
-node_t* find_node_from_poll_index(int* poll_idx) {
+long get_time_ms() {
 
-    var_t* var = get_var();
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
 
-	node_t* dummy = malloc(sizeof(node_t));
-    ALLOC_ERR(dummy);
-	dummy->socket_fd = var->poll_fd[*poll_idx].fd;
+#ifdef CONNMGR_USE_POLL
 
-	int node_idx = dpl_get_index_of_element(var->list, dummy);
-	node_t* node = dpl_get_element_at_index(var->list, node_idx);
-	free(dummy);
+void events_init(connmgr_t* mgr) {
 
-	return node;
+    mgr->poll_fd = calloc(1, sizeof(poll_fd_t));
+    ALLOC_ERR(mgr->poll_fd);
+    mgr->poll_fd->fd = mgr->server_fd;
+    mgr->poll_fd->events = POLLIN;
+    mgr->poll_max = 1;
 }
 
-int receive_data(tcpsock_t* client, sensor_data_t* data, int* bytes) {
+int events_wait(connmgr_t* mgr, int timeout_ms) {
+
+    int ready = 0;
 
-	*bytes = sizeof(data->id);
-    tcp_receive(client, &(data->id), bytes);
-    *bytes = sizeof(data->value);
-	tcp_receive(client, &(data->value), bytes);
-    *bytes = sizeof(data->ts);
+    // the listener is always first, and the only one waited on when throttled
+    int rc = poll(mgr->poll_fd, mgr->throttled ? 1 : mgr->poll_max, timeout_ms);
+    SYS_ERR(rc);
 
-	return tcp_receive(client, &(data->ts), bytes);
+    for (int poll_idx = 0; poll_idx < (mgr->throttled ? 1 : mgr->poll_max) && ready < CONNMGR_MAX_EVENTS; poll_idx++)
+        if (mgr->poll_fd[poll_idx].fd > 0 && mgr->poll_fd[poll_idx].revents & (POLLIN | POLLHUP | POLLERR))
+            mgr->ready[ready++] = mgr->poll_fd[poll_idx].fd;
+
+    return ready;
 }
 
-void node_free(void** node) {
-	free(*node);
+void events_add(connmgr_t* mgr, int socket_fd) {
+
+    int poll_idx = 0;
+
+    while (poll_idx != mgr->poll_max && mgr->poll_fd[poll_idx].fd != -1)
+        poll_idx++;
+
+    if (poll_idx == mgr->poll_max) {
+        REALLOC_CHECK( mgr->poll_fd, (mgr->poll_max + 1) * sizeof(poll_fd_t) );
+        (mgr->poll_max)++;
+    }
+
+    mgr->poll_fd[poll_idx].fd = socket_fd;
+    mgr->poll_fd[poll_idx].events = POLLIN;
+    mgr->poll_fd[poll_idx].revents = 0;
 }
 
-int node_compare(void* node_1, void* node_2) {
+void events_remove(connmgr_t* mgr, int socket_fd) {
+
+    for (int poll_idx = 1; poll_idx < mgr->poll_max; poll_idx++) {
+        if (mgr->poll_fd[poll_idx].fd == socket_fd) {
+            mgr->poll_fd[poll_idx].fd = -1;
+            break;
+        }
+    }
 
-	int fd_1 = ((node_t*)node_1)->socket_fd;
-	int fd_2 = ((node_t*)node_2)->socket_fd;
-	if (fd_1 < fd_2) return -1;
-	else if (fd_1 == fd_2) return 0;
-	else return 1;
+    while (mgr->poll_max > 1 && mgr->poll_fd[mgr->poll_max - 1].fd == -1)
+        (mgr->poll_max)--;
 }
 
-var_t* get_var() {
+void events_throttle(connmgr_t* mgr) {
 
-    static var_t* var;
-    if (var == NULL) {
-        var = malloc(sizeof(var_t));
-        ALLOC_ERR(var);
+    (void)mgr;
+}
+
+void events_free(connmgr_t* mgr) {
+
+    free(mgr->poll_fd);
+}
+
+#else
+
+void events_init(connmgr_t* mgr) {
+
+    mgr->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    SYS_ERR(mgr->epoll_fd);
+
+    events_add(mgr, mgr->server_fd);
+}
+
+int events_wait(connmgr_t* mgr, int timeout_ms) {
+
+    int ready = epoll_wait(mgr->epoll_fd, mgr->events, CONNMGR_MAX_EVENTS, timeout_ms);
+    SYS_ERR(ready);
+
+    for (int i = 0; i < ready; i++)
+        mgr->ready[i] = mgr->events[i].data.fd;
+
+    return ready;
+}
+
+// while throttled, new sensor sockets only go into the table and are added
+// with the others by events_throttle()
+void events_add(connmgr_t* mgr, int socket_fd) {
+
+    if (mgr->throttled && socket_fd != mgr->server_fd)
+        return;
+
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = socket_fd };
+    SYS_ERR( epoll_ctl(mgr->epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) );
+}
+
+void events_remove(connmgr_t* mgr, int socket_fd) {
+
+    if (mgr->throttled)
+        return;
+
+    SYS_ERR( epoll_ctl(mgr->epoll_fd, EPOLL_CTL_DEL, socket_fd, NULL) );
+}
+
+// a socket left in the set with no events would still report hang-ups, so
+// the sensor sockets are removed outright and added back on resume
+void events_throttle(connmgr_t* mgr) {
+
+    for (int socket_fd = 0; socket_fd < mgr->table_size; socket_fd++) {
+        if (mgr->table[socket_fd] == NULL)
+            continue;
+
+        if (mgr->throttled) {
+            SYS_ERR( epoll_ctl(mgr->epoll_fd, EPOLL_CTL_DEL, socket_fd, NULL) );
+        } else {
+            struct epoll_event event = { .events = EPOLLIN, .data.fd = socket_fd };
+            SYS_ERR( epoll_ctl(mgr->epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) );
+        }
     }
-    return var;
 }
+
+void events_free(connmgr_t* mgr) {
+
+    SYS_ERR( close(mgr->epoll_fd) );
+}
+
+#endif
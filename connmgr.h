@@ -7,8 +7,27 @@
     #error TIMEOUT not set
 #endif
 
-void connmgr_listen(int port_number, sbuffer_t** buffer);
-void connmgr_free();
+#ifndef CONNMGR_MAX_EVENTS
+    #define CONNMGR_MAX_EVENTS 256 // ready sockets handled per wakeup
+#endif
+
+#ifndef CONNMGR_RECV_SIZE
+    #define CONNMGR_RECV_SIZE 4096 // bytes drained from a socket per read
+#endif
+
+#ifndef CONNMGR_WORKERS
+    #define CONNMGR_WORKERS 1 // connmgr threads sharing the port through SO_REUSEPORT
+#endif
+
+#ifndef CONNMGR_THROTTLE_MS
+    #define CONNMGR_THROTTLE_MS 10 // how often a throttled connmgr checks the buffer fill again
+#endif
+
+typedef struct connmgr connmgr_t;
+
+connmgr_t* connmgr_init(int port_number, sbuffer_t* buffer);
+void connmgr_listen(connmgr_t* mgr);
+void connmgr_free(connmgr_t** mgr);
 
 
 #endif /* CONNMGR_H */
@@ -8,47 +8,84 @@
 #include <inttypes.h>
 #include <pthread.h>
 #include <time.h>
+#include <math.h>
 
-#include "lib/dplist.h"
 #include "datamgr.h"
+#include "metrics.h"
 #include "errmacros.h"
 
+// every possible sensor_id_t has a slot, so a lookup is a single load
+#define SENSOR_ID_COUNT (UINT16_MAX + 1)
+
 typedef uint16_t room_id_t;
 
+typedef struct node node_t;
+
+typedef enum {
+    ALERT_NORMAL,
+    ALERT_COLD,
+    ALERT_HOT
+} alert_state_t;
+
 typedef struct var {
-    dplist_t* list;
+    node_t** index;
+    int total;
+    int window_length;
 } var_t;
 
-typedef struct node {
+// sliding window of sample sequence numbers whose values are monotonic,
+// so the front is always the window minimum (or maximum)
+typedef struct deque {
+    long* sequence;
+    int head;
+    int size;
+} deque_t;
+
+struct node {
 	sensor_id_t sensor_id;
 	room_id_t room_id;
 	sensor_ts_t last_modified;
 	sensor_value_t running_avg;
-	sensor_value_t running_buffer[RUN_AVG_LENGTH];
+	sensor_value_t* running_buffer;
 	int running_index;
-  	char buffer_is_full;
-} node_t;
-
-static void node_free(void** element);
-static int node_compare(void* x, void* y);
-static void create_node(int* room_id, int* sensor_id);
+	int window_length;
+	int samples;
+	long sequence;
+	sensor_value_t sum;
+	sensor_value_t sum_squares;
+	sensor_value_t ewma;
+	deque_t min;
+	deque_t max;
+	sensor_value_t hysteresis;
+	alert_state_t alert;
+	sensor_ts_t raised;
+	sensor_ts_t notified;
+	int suppressed;
+	long suppressed_total;
+};
+
+static void load_sensor_map(FILE* fp_sensor_map);
+static void create_node(int* room_id, int* sensor_id, sensor_value_t hysteresis);
 static node_t* get_node_from_sensor_id(sensor_id_t sensor_id);
-static void calculate_running_average(node_t* node);
+static void update_statistics(node_t* node, sensor_value_t value);
+static void update_deque(node_t* node, deque_t* deque, sensor_value_t value, int keep_smaller);
+static sensor_value_t deque_front(node_t* node, deque_t* deque);
 static void process_data(node_t* node, sensor_data_t data);
+static void update_alert(node_t* node);
+static alert_state_t next_alert(node_t* node);
+static sensor_value_t alert_band(node_t* node);
+static sensor_value_t window_variance(node_t* node);
 static var_t* get_var();
+static var_t** get_var_ref();
 
 
 void datamgr_parse_sensor_files(FILE* fp_sensor_map, FILE* fp_sensor_data) {
 
-	var_t* var = get_var();
 	sensor_data_t data;
-	int room_id, sensor_id;
-
-	var->list = dpl_create(NULL, &node_free, &node_compare);
 
-	while (fscanf(fp_sensor_map, "%" PRIu16 " %" PRIu16 "\n", &room_id, &sensor_id) == 2)
-		create_node(&room_id, &sensor_id);
+	load_sensor_map(fp_sensor_map);
 
+	data.ingest_ns = 0;
 	while (fread(&data.id, sizeof(sensor_id_t), 1, fp_sensor_data) == 1) {
 		fread(&data.value, sizeof(sensor_value_t), 1, fp_sensor_data);
 		fread(&data.ts, sizeof(sensor_ts_t), 1, fp_sensor_data);
@@ -59,151 +96,341 @@ void datamgr_parse_sensor_files(FILE* fp_sensor_map, FILE* fp_sensor_data) {
 	}
 }
 
-void datamgr_parse_sensor_data(FILE* fp_sensor_map, sbuffer_t** buffer) {
+void datamgr_init(FILE* fp_sensor_map) {
 
-	var_t* var = get_var();
-    sensor_data_t data;
-	int room_id, sensor_id;
+	load_sensor_map(fp_sensor_map);
+}
 
-	var->list = dpl_create(NULL, &node_free, &node_compare);
+// the sensor table is only read concurrently: every node belongs to exactly
+// one shard, so its statistics are only ever touched by that shard's worker
+void datamgr_parse_sensor_data(sbuffer_t** buffer, int shard) {
 
-	while (fscanf(fp_sensor_map, "%" PRIu16 " %" PRIu16 "\n", &room_id, &sensor_id) == 2)
-        create_node(&room_id, &sensor_id);
+    sensor_data_t data[SBUFFER_BATCH_SIZE];
+	int count;
 
 	while (*buffer != NULL) {
 
-        if ( sbuffer_check_buffer(*buffer, 0) == 0 )
+        if ( sbuffer_check_buffer(*buffer, shard) == 0 )
             break;
 
-        int rc = sbuffer_read(*buffer, &data);
+        int rc = sbuffer_read_batch(*buffer, shard, data, SBUFFER_BATCH_SIZE, &count);
         SBUFFER_ERR(rc);
 
-        if (rc == SBUFFER_NO_DATA)
-            continue;
-
-		node_t* node = get_node_from_sensor_id(data.id);
-		if (node)
-            process_data(node, data);
+        int processed = 0;
+        for (int i = 0; i < count; i++) {
+		    node_t* node = get_node_from_sensor_id(data[i].id);
+		    if (node) {
+                process_data(node, data[i]);
+                processed++;
+            }
+        }
+        metrics_add(METRIC_READINGS_PROCESSED, processed);
+        metrics_latency(LATENCY_DATAMGR, data, count);
+        metrics_add(METRIC_READINGS_INVALID, count - processed);
 	}
 
 }
 
+// forgets the window set with datamgr_set_window() along with the sensors
 void datamgr_free() {
 
 	var_t* var = get_var();
-	dpl_free(&var->list, true);
+
+	for (int sensor_id = 0; sensor_id < SENSOR_ID_COUNT && var->index != NULL; sensor_id++) {
+		node_t* node = var->index[sensor_id];
+		if (node == NULL)
+			continue;
+		free(node->running_buffer);
+		free(node->min.sequence);
+		free(node->max.sequence);
+		free(node);
+	}
+	free(var->index);
 	free(var);
+	*get_var_ref() = NULL;
+}
+
+void load_sensor_map(FILE* fp_sensor_map) {
+
+	var_t* var = get_var();
+	int room_id, sensor_id;
+	double hysteresis;
+	char* line = NULL;
+	size_t size = 0;
+
+	var->index = calloc(SENSOR_ID_COUNT, sizeof(node_t*));
+	ALLOC_ERR(var->index);
+	var->total = 0;
+
+	// "room sensor [hysteresis]" per line
+	while (getline(&line, &size, fp_sensor_map) != -1) {
+		int fields = sscanf(line, "%" PRIu16 " %" PRIu16 " %lf", &room_id, &sensor_id, &hysteresis);
+		if (fields < 2)
+			break;
+		create_node(&room_id, &sensor_id, fields == 3 && hysteresis >= 0 ? hysteresis : ALERT_HYSTERESIS);
+	}
+	free(line);
+}
+
+void datamgr_set_window(int length) {
+
+	get_var()->window_length = length > 0 ? length : RUN_AVG_LENGTH;
 }
 
 void process_data(node_t* node, sensor_data_t data) {
 
     node->last_modified = data.ts;
-    node->running_buffer[node->running_index] = data.value;
 
-    calculate_running_average(node);
+    update_statistics(node, data.value);
+    update_alert(node);
+}
 
-    if (node->running_avg < SET_MIN_TEMP)
+// only state changes are logged: an alert is raised when the running avg
+// crosses a limit, reported again at most every ALERT_RENOTIFY seconds and
+// cleared once the avg is back inside the band of alert_band(), but never
+// before it held ALERT_HOLD seconds, every reading in between is only counted
+void update_alert(node_t* node) {
+
+    alert_state_t state = next_alert(node);
+
+    if (state != node->alert && node->alert != ALERT_NORMAL && node->last_modified - node->raised < ALERT_HOLD)
+        state = node->alert;
+
+    if (state == node->alert) {
+        if (state == ALERT_NORMAL)
+            return;
+        if (node->last_modified - node->notified < ALERT_RENOTIFY) {
+            node->suppressed++;
+            node->suppressed_total++;
+            return;
+        }
+    }
+
+    if (state == node->alert && state == ALERT_COLD)
+        LOG_PRINTF("The sensor node with %d still reports it’s too cold (running avg temperature = %.3f, %d readings suppressed)\n", node->sensor_id, node->running_avg, node->suppressed);
+    else if (state == node->alert && state == ALERT_HOT)
+        LOG_PRINTF("The sensor node with %d still reports it’s too hot (running avg temperature = %.3f, %d readings suppressed)\n", node->sensor_id, node->running_avg, node->suppressed);
+    else if (state == ALERT_COLD)
         LOG_PRINTF("The sensor node with %d reports it’s too cold (running avg temperature = %.3f)\n", node->sensor_id, node->running_avg);
-    if (node->running_avg > SET_MAX_TEMP)
+    else if (state == ALERT_HOT)
         LOG_PRINTF("The sensor node with %d reports it’s too hot (running avg temperature = %.3f)\n", node->sensor_id, node->running_avg);
+    else
+        LOG_PRINTF("The sensor node with %d is back to normal (running avg temperature = %.3f, %d readings suppressed)\n", node->sensor_id, node->running_avg, node->suppressed);
+
+    if (state != node->alert)
+        node->raised = node->last_modified;
+    node->alert = state;
+    node->notified = node->last_modified;
+    node->suppressed = 0;
+}
 
-    node->running_index++;
+alert_state_t next_alert(node_t* node) {
 
-    if (node->running_index == RUN_AVG_LENGTH) {
-        node->running_index = 0;
-        node->buffer_is_full = 1;
-    }
+    sensor_value_t band = alert_band(node);
+
+    if (node->running_avg < SET_MIN_TEMP)
+        return ALERT_COLD;
+    if (node->running_avg > SET_MAX_TEMP)
+        return ALERT_HOT;
+
+    if (node->alert == ALERT_COLD && node->running_avg < SET_MIN_TEMP + band)
+        return ALERT_COLD;
+    if (node->alert == ALERT_HOT && node->running_avg > SET_MAX_TEMP - band)
+        return ALERT_HOT;
+
+    return ALERT_NORMAL;
+}
+
+// the standard error of the running avg grows with the spread of the window,
+// so a noisy sensor needs to come back further before its alert clears
+sensor_value_t alert_band(node_t* node) {
+
+	sensor_value_t noise = ALERT_NOISE_SIGMAS * sqrt(window_variance(node) / node->samples);
+
+	return noise > node->hysteresis ? noise : node->hysteresis;
+}
+
+sensor_value_t window_variance(node_t* node) {
+
+	sensor_value_t variance = node->sum_squares / node->samples - node->running_avg * node->running_avg;
+
+	return variance > 0 ? variance : 0;
 }
 
-void create_node(int* room_id, int* sensor_id) {
+void create_node(int* room_id, int* sensor_id, sensor_value_t hysteresis) {
 
 	var_t* var = get_var();
+
+	if (*sensor_id < 0 || *sensor_id >= SENSOR_ID_COUNT || var->index[*sensor_id] != NULL)
+		return;
+
 	node_t* node = calloc(1, sizeof(node_t));
 	ALLOC_ERR(node);
 
+	node->window_length = var->window_length > 0 ? var->window_length : RUN_AVG_LENGTH;
+	node->running_buffer = calloc(node->window_length, sizeof(sensor_value_t));
+	node->min.sequence = calloc(node->window_length, sizeof(long));
+	node->max.sequence = calloc(node->window_length, sizeof(long));
+	ALLOC_ERR(node->running_buffer);
+	ALLOC_ERR(node->min.sequence);
+	ALLOC_ERR(node->max.sequence);
+
 	node->sensor_id = *sensor_id;
 	node->room_id = *room_id;
-	dpl_insert_at_index(var->list, node, -1, false);
+	node->hysteresis = hysteresis;
+	var->index[*sensor_id] = node;
+	var->total++;
 }
 
 node_t* get_node_from_sensor_id(sensor_id_t sensor_id) {
 
 	var_t* var = get_var();
-	node_t* dummy = malloc(sizeof(node_t));
-	ALLOC_ERR(dummy);
+	node_t* node = var->index != NULL ? var->index[sensor_id] : NULL;
 
-	dummy->sensor_id = sensor_id;
-	int index = dpl_get_index_of_element(var->list, dummy);
-	free(dummy);
-
-	if (index == -1) {
+	if (node == NULL)
 		LOG_PRINTF("Received sensor data with invalid sensor node ID %d\n", sensor_id);
-		return NULL;
-	}
 
-	return dpl_get_element_at_index(var->list, index);
+	return node;
 }
 
-void calculate_running_average(node_t* node) {
+// O(1) per sample: the value leaving the window is subtracted from the
+// running sums instead of re-summing the buffer, and the sums are rebuilt
+// exactly once per lap of the window so rounding errors cannot accumulate
+void update_statistics(node_t* node, sensor_value_t value) {
+
+	if (node->samples == node->window_length) {
+		sensor_value_t oldest = node->running_buffer[node->running_index];
+		node->sum -= oldest;
+		node->sum_squares -= oldest * oldest;
+	} else {
+		node->samples++;
+	}
 
-	sensor_value_t sum = 0;
+	node->running_buffer[node->running_index] = value;
+	node->sum += value;
+	node->sum_squares += value * value;
 
-	for (int i = 0; i < RUN_AVG_LENGTH; i++)
-		sum += node->running_buffer[i];
+	update_deque(node, &node->min, value, 1);
+	update_deque(node, &node->max, value, 0);
 
-	if (node->buffer_is_full == 0)
-		node->running_avg = sum / (node->running_index + 1);
+	if (node->sequence == 0)
+		node->ewma = value;
 	else
-		node->running_avg = sum / RUN_AVG_LENGTH;
+		node->ewma += 2.0 / (node->window_length + 1) * (value - node->ewma);
+
+	node->sequence++;
+	node->running_index++;
+
+	if (node->running_index == node->window_length) {
+		node->running_index = 0;
+		node->sum = node->sum_squares = 0;
+		for (int i = 0; i < node->window_length; i++) {
+			node->sum += node->running_buffer[i];
+			node->sum_squares += node->running_buffer[i] * node->running_buffer[i];
+		}
+	}
+
+	node->running_avg = node->sum / node->samples;
+}
+
+void update_deque(node_t* node, deque_t* deque, sensor_value_t value, int keep_smaller) {
+
+	int length = node->window_length;
+
+	if (deque->size > 0 && deque->sequence[deque->head] <= node->sequence - length) {
+		deque->head = (deque->head + 1) % length;
+		deque->size--;
+	}
+
+	while (deque->size > 0) {
+		int back = (deque->head + deque->size - 1) % length;
+		sensor_value_t last = node->running_buffer[deque->sequence[back] % length];
+		if ( (keep_smaller && last < value) || (!keep_smaller && last > value) )
+			break;
+		deque->size--;
+	}
+
+	deque->sequence[(deque->head + deque->size) % length] = node->sequence;
+	deque->size++;
+}
+
+sensor_value_t deque_front(node_t* node, deque_t* deque) {
+
+	if (deque->size == 0)
+		return 0;
+
+	return node->running_buffer[deque->sequence[deque->head] % node->window_length];
 }
 
 uint16_t datamgr_get_room_id(sensor_id_t sensor_id) {
 
 	node_t* node = get_node_from_sensor_id(sensor_id);
+	if (node == NULL)
+		return 0;
+
 	return node->room_id;
 }
 
 sensor_value_t datamgr_get_avg(sensor_id_t sensor_id) {
 
 	node_t* node = get_node_from_sensor_id(sensor_id);
-	sensor_value_t sum = 0;
+	if (node == NULL)
+		return NAN;
 
-	for (int i = 0; i < RUN_AVG_LENGTH; i++)
-		sum += node->running_buffer[i];
+	return node->running_avg;
+}
+
+int datamgr_get_stats(sensor_id_t sensor_id, datamgr_stats_t* stats) {
 
-	return sum / RUN_AVG_LENGTH;
+	node_t* node = get_node_from_sensor_id(sensor_id);
+	if (node == NULL || node->samples == 0)
+		return -1;
+
+	stats->samples = node->samples;
+	stats->avg = node->running_avg;
+	stats->ewma = node->ewma;
+	stats->min = deque_front(node, &node->min);
+	stats->max = deque_front(node, &node->max);
+	stats->variance = window_variance(node);
+
+	return 0;
+}
+
+// -1 for a sensor id missing from the room map
+long datamgr_get_suppressed(sensor_id_t sensor_id) {
+
+	node_t* node = get_node_from_sensor_id(sensor_id);
+	if (node == NULL)
+		return -1;
+
+	return node->suppressed_total;
 }
 
 time_t datamgr_get_last_modified(sensor_id_t sensor_id) {
 
 	node_t* node = get_node_from_sensor_id(sensor_id);
+	if (node == NULL)
+		return -1;
+
 	return node->last_modified;
 }
 
 int datamgr_get_total_sensors() {
-	var_t* var = get_var();
-	return dpl_size(var->list);
-}
-
-void node_free(void** element) {
-	free(*element);
+	return get_var()->total;
 }
 
-int node_compare(void* node_1, void* node_2) {
+var_t* get_var() {
 
-	sensor_id_t id_1 = ((node_t*)node_1)->sensor_id;
-	sensor_id_t id_2 = ((node_t*)node_2)->sensor_id;
-	if (id_1 < id_2) return -1;
-	else if (id_1 == id_2) return 0;
-	else return 1;
+    var_t** var = get_var_ref();
+    if (*var == NULL) {
+        *var = calloc(1, sizeof(var_t));
+        ALLOC_ERR(*var);
+    }
+    return *var;
 }
 
-var_t* get_var() {
+var_t** get_var_ref() {
 
     static var_t* var;
-    if (var == NULL) {
-        var = malloc(sizeof(var_t));
-        ALLOC_ERR(var);
-    }
-    return var;
+    return &var;
 }
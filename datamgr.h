@@ -8,7 +8,7 @@
 #include "sbuffer.h"
 
 #ifndef RUN_AVG_LENGTH
-  #define RUN_AVG_LENGTH 5
+  #define RUN_AVG_LENGTH 5 // default window, see datamgr_set_window()
 #endif
 
 #ifndef SET_MAX_TEMP
@@ -19,12 +19,47 @@
   #error SET_MIN_TEMP not set
 #endif
 
+// an alert clears once the running avg is back inside the limit by the
+// larger of the sensor's hysteresis and ALERT_NOISE_SIGMAS standard errors of
+// the window, so the band widens with the sensor's own noise; the hysteresis
+// of a sensor can be given as a third column of the room map
+#ifndef ALERT_HYSTERESIS
+  #define ALERT_HYSTERESIS 1.0 // degrees, for sensors without one in the room map
+#endif
+
+#ifndef ALERT_NOISE_SIGMAS
+  #define ALERT_NOISE_SIGMAS 3 // standard errors of the running avg the band spans at least
+#endif
+
+#ifndef ALERT_HOLD
+  #define ALERT_HOLD 30 // seconds an alert is kept before it may clear or flip
+#endif
+
+#ifndef ALERT_RENOTIFY
+  #define ALERT_RENOTIFY 60 // seconds before an alert that still holds is reported again
+#endif
+
+typedef struct {
+  int samples;              // readings currently in the window
+  sensor_value_t avg;       // mean over the window
+  sensor_value_t ewma;      // exponentially weighted, alpha = 2 / (window + 1)
+  sensor_value_t min;
+  sensor_value_t max;
+  sensor_value_t variance;  // population variance over the window
+} datamgr_stats_t;
+
 
+void datamgr_set_window(int length);
 void datamgr_parse_sensor_files(FILE * fp_sensor_map, FILE * fp_sensor_data);
-void datamgr_parse_sensor_data(FILE * fp_sensor_map, sbuffer_t ** buffer);
+void datamgr_init(FILE * fp_sensor_map);
+void datamgr_parse_sensor_data(sbuffer_t ** buffer, int shard);
 void datamgr_free();
+// for a sensor id missing from the room map the getters below return room 0,
+// an average of NAN, and -1 for the rest
 uint16_t datamgr_get_room_id(sensor_id_t sensor_id);
 sensor_value_t datamgr_get_avg(sensor_id_t sensor_id);
+int datamgr_get_stats(sensor_id_t sensor_id, datamgr_stats_t* stats);
+long datamgr_get_suppressed(sensor_id_t sensor_id);
 time_t datamgr_get_last_modified(sensor_id_t sensor_id);
 int datamgr_get_total_sensors();
 
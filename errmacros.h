@@ -17,13 +17,15 @@
 	#define DEBUG_PRINTF(...) (void)0
 #endif
 
-// print the string into FIFO
-#define LOG_PRINTF(...) \
-	do { \
-        char log[LOG_LENGTH]; \
-        snprintf(log, LOG_LENGTH, __VA_ARGS__); \
-        log_write(log); \
-    } while(0)
+// hand a log record to the log process, which does the formatting; the
+// format and any %s argument must outlive the record, e.g. string literals
+#define LOG_PRINTF(...) LOG_SELECT(__VA_ARGS__, LOG_4, LOG_3, LOG_2, LOG_1, LOG_0, _)(__VA_ARGS__)
+#define LOG_SELECT(_0, _1, _2, _3, _4, NAME, ...) NAME
+#define LOG_0(format) log_record(format, 0, NULL)
+#define LOG_1(format, a) log_record(format, 1, (log_arg_t[]){ LOG_ARG(a) })
+#define LOG_2(format, a, b) log_record(format, 2, (log_arg_t[]){ LOG_ARG(a), LOG_ARG(b) })
+#define LOG_3(format, a, b, c) log_record(format, 3, (log_arg_t[]){ LOG_ARG(a), LOG_ARG(b), LOG_ARG(c) })
+#define LOG_4(format, a, b, c, d) log_record(format, 4, (log_arg_t[]){ LOG_ARG(a), LOG_ARG(b), LOG_ARG(c), LOG_ARG(d) })
 
 // general errors with no condition
 #define ERROR_PRINTF(...) \
@@ -139,19 +141,6 @@
 		} \
 	} while(0)
 
-// errors regarding creation of FIFO files
-#define MKFIFO_ERR(rc) \
-	do { \
-		if (rc == -1) { \
-			if ( errno != EEXIST ) { \
-				LINE_PRINT(); \
-				fprintf(stderr, "Error Code %d\n", rc); \
-				perror("MKFIFO error"); \
-				exit(EXIT_FAILURE); \
-			} \
-		} \
-	} while(0)
-
 // errors regarding pthread barriers
 #define BARRIER_ERR(rc) \
     do { \
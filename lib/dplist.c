@@ -1,8 +1,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "dplist.h"
+#include "pool.h"
 
 #define DPLIST_NO_ERROR 0
 #define DPLIST_MEMORY_ERROR 1 // error due to mem alloc failure
@@ -31,6 +33,9 @@ struct dplist_node {
 	void * element;
 };
 
+static void create_node_pool();
+static pool_t * get_node_pool();
+
 struct dplist {
 	dplist_node_t * head;
 	void * (*element_copy)(void * src_element);
@@ -67,7 +72,7 @@ void dpl_free(dplist_t ** list, bool free_element)
 		if (free_element)
 			(*list)->element_free( &(current->element) );
 
-		free(current);
+		pool_release(get_node_pool(), current);
 		current = next;
 	}
 
@@ -82,7 +87,7 @@ dplist_t * dpl_insert_at_index(dplist_t * list, void * element, int index, bool
 	dplist_node_t * ref_at_index;
 	dplist_node_t * list_node;
 
-	list_node = malloc(sizeof(dplist_node_t));
+	list_node = pool_alloc(get_node_pool());
 	DPLIST_ERR_HANDLER(list_node == NULL, DPLIST_MEMORY_ERROR);
 
 	if (insert_copy)
@@ -160,7 +165,7 @@ dplist_t * dpl_remove_at_index( dplist_t * list, int index, bool free_element)
 	if (free_element)
 		list->element_free( &(ref_at_index->element) );
 
-	free(ref_at_index);
+	pool_release(get_node_pool(), ref_at_index);
 	return list;
 }
 
@@ -400,3 +405,19 @@ dplist_t * dpl_remove_element( dplist_t * list, void * element, bool free_elemen
 
 	return dpl_remove_at_index(list, index, free_element);
 }
+
+// list nodes of every list come from one pool, created on first use
+static pool_t * node_pool;
+static pthread_once_t node_pool_once = PTHREAD_ONCE_INIT;
+
+void create_node_pool()
+{
+	node_pool = pool_create(sizeof(dplist_node_t));
+	DPLIST_ERR_HANDLER(node_pool == NULL, DPLIST_MEMORY_ERROR);
+}
+
+pool_t * get_node_pool()
+{
+	pthread_once(&node_pool_once, create_node_pool);
+	return node_pool;
+}
@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "pool.h"
+
+#define POOL_ALIGN(n) (((n) + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1))
+
+typedef struct pool_object {
+	struct pool_object * next;
+} pool_object_t;
+
+typedef struct pool_slab {
+	struct pool_slab * next;
+} pool_slab_t;
+
+struct pool {
+	pthread_mutex_t lock;
+	size_t size;
+	int slot;
+	unsigned long generation; // tells this pool apart from an earlier one in the same slot
+	pool_object_t * free;
+	pool_slab_t * slabs;
+};
+
+// a thread's cache of one pool; objects left in it when the thread exits are
+// only given back when the pool is destroyed
+typedef struct pool_cache {
+	unsigned long generation;
+	pool_object_t * free;
+	int count;
+} pool_cache_t;
+
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_t * pools[POOL_MAX];
+static unsigned long generation;
+static _Thread_local pool_cache_t caches[POOL_MAX];
+
+static pool_cache_t * get_cache(pool_t * pool);
+static int refill_cache(pool_t * pool, pool_cache_t * cache);
+static void flush_cache(pool_t * pool, pool_cache_t * cache, int count);
+
+
+pool_t * pool_create(size_t size)
+{
+	pool_t * pool = calloc(1, sizeof(pool_t));
+	if (pool == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pool->size = POOL_ALIGN(size > sizeof(pool_object_t) ? size : sizeof(pool_object_t));
+	pool->slot = -1;
+	pthread_mutex_init(&pool->lock, NULL);
+
+	pthread_mutex_lock(&pools_lock);
+	for (int i = 0; i < POOL_MAX; i++) {
+		if (pools[i] == NULL) {
+			pools[i] = pool;
+			pool->slot = i;
+			pool->generation = ++generation;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pools_lock);
+
+	if (pool->slot == -1) {
+		pthread_mutex_destroy(&pool->lock);
+		free(pool);
+		errno = ENOSPC;
+		return NULL;
+	}
+	return pool;
+}
+
+void pool_destroy(pool_t ** pool)
+{
+	assert(*pool != NULL);
+
+	pthread_mutex_lock(&pools_lock);
+	pools[(*pool)->slot] = NULL;
+	pthread_mutex_unlock(&pools_lock);
+
+	pool_slab_t * slab = (*pool)->slabs;
+	while (slab != NULL) {
+		pool_slab_t * next = slab->next;
+		free(slab);
+		slab = next;
+	}
+
+	pthread_mutex_destroy(&(*pool)->lock);
+	free(*pool);
+	*pool = NULL;
+}
+
+void * pool_alloc(pool_t * pool)
+{
+	pool_cache_t * cache = get_cache(pool);
+
+	if (cache->free == NULL && refill_cache(pool, cache) != 0)
+		return NULL;
+
+	pool_object_t * object = cache->free;
+	cache->free = object->next;
+	cache->count--;
+	return object;
+}
+
+void pool_release(pool_t * pool, void * object)
+{
+	if (object == NULL)
+		return;
+
+	pool_cache_t * cache = get_cache(pool);
+	pool_object_t * released = object;
+
+	released->next = cache->free;
+	cache->free = released;
+
+	// a thread that only frees (objects allocated elsewhere) hands them back
+	if (++cache->count > 2 * POOL_BATCH)
+		flush_cache(pool, cache, POOL_BATCH);
+}
+
+pool_cache_t * get_cache(pool_t * pool)
+{
+	pool_cache_t * cache = &caches[pool->slot];
+
+	// the cache still holds objects of a destroyed pool, whose slabs are gone
+	if (cache->generation != pool->generation) {
+		cache->generation = pool->generation;
+		cache->free = NULL;
+		cache->count = 0;
+	}
+	return cache;
+}
+
+int refill_cache(pool_t * pool, pool_cache_t * cache)
+{
+	pthread_mutex_lock(&pool->lock);
+
+	if (pool->free == NULL) {
+		pool_slab_t * slab = malloc(POOL_ALIGN(sizeof(pool_slab_t)) + POOL_SLAB_SIZE * pool->size);
+		if (slab == NULL) {
+			pthread_mutex_unlock(&pool->lock);
+			return -1;
+		}
+		slab->next = pool->slabs;
+		pool->slabs = slab;
+
+		char * objects = (char *)slab + POOL_ALIGN(sizeof(pool_slab_t));
+		for (int i = POOL_SLAB_SIZE - 1; i >= 0; i--) {
+			pool_object_t * object = (pool_object_t *)(objects + i * pool->size);
+			object->next = pool->free;
+			pool->free = object;
+		}
+	}
+
+	for (int i = 0; i < POOL_BATCH && pool->free != NULL; i++) {
+		pool_object_t * object = pool->free;
+		pool->free = object->next;
+		object->next = cache->free;
+		cache->free = object;
+		cache->count++;
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+void flush_cache(pool_t * pool, pool_cache_t * cache, int count)
+{
+	pthread_mutex_lock(&pool->lock);
+
+	for (int i = 0; i < count && cache->free != NULL; i++) {
+		pool_object_t * object = cache->free;
+		cache->free = object->next;
+		object->next = pool->free;
+		pool->free = object;
+		cache->count--;
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+}
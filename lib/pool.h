@@ -0,0 +1,30 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stddef.h>
+
+#ifndef POOL_SLAB_SIZE
+	#define POOL_SLAB_SIZE 256 // objects carved out of one malloc when a pool runs dry
+#endif
+
+#ifndef POOL_BATCH
+	#define POOL_BATCH 32 // objects moved at once between a thread cache and the shared pool
+#endif
+
+#ifndef POOL_MAX
+	#define POOL_MAX 16 // pools that can be alive at the same time: one per connmgr worker and one for dplist
+#endif
+
+// a pool hands out objects of one fixed size from slabs that are only freed
+// with the pool; every thread allocates from and frees to its own cache and
+// only takes the pool lock to move a batch of objects in or out of it
+typedef struct pool pool_t;
+
+// returns NULL with errno ENOMEM when out of memory, or ENOSPC when POOL_MAX
+// pools are already alive
+pool_t * pool_create(size_t size);
+void pool_destroy(pool_t ** pool);
+void * pool_alloc(pool_t * pool);
+void pool_release(pool_t * pool, void * object);
+
+#endif  // _POOL_H_
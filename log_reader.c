@@ -0,0 +1,54 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <glob.h>
+
+#include "config.h"
+#include "logger.h"
+
+static void print_help();
+
+
+// prints the binary gateway log segments as text, in the order they were
+// written; without arguments every segment of the last run is printed
+int main(int argc, char* argv[]) {
+
+    glob_t segments = { 0 };
+    int result = 0;
+
+    if (argc > 1 && argv[1][0] == '-') {
+        print_help();
+        return 0;
+    }
+
+    if (argc == 1) {
+        // segment numbers are zero padded, so glob's sort is their order
+        if (glob(LOG_NAME ".[0-9]*", 0, NULL, &segments) != 0) {
+            fprintf(stderr, "No log segments found\n");
+            return 1;
+        }
+    } else {
+        segments.gl_pathc = argc - 1;
+        segments.gl_pathv = argv + 1;
+    }
+
+    for (size_t i = 0; i < segments.gl_pathc; i++) {
+        if (log_render(segments.gl_pathv[i], stdout) != 0) {
+            fprintf(stderr, "%s is not a gateway log segment\n", segments.gl_pathv[i]);
+            result = 1;
+        }
+    }
+
+    if (argc == 1)
+        globfree(&segments);
+    return result;
+}
+
+void print_help() {
+
+    printf("Use this program with 0 or more command line options: \n");
+    printf("\t%-15s : the log segments to print, all " LOG_NAME ".* segments if none are given\n", "\'SEGMENT...\'");
+}
@@ -0,0 +1,619 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "logger.h"
+#include "errmacros.h"
+
+#define LOG_MASK (LOG_CAPACITY - 1)
+#define LOG_CACHE_LINE 64
+
+typedef struct log_slot {
+    long long stamp_ns; // monotonic, used to merge the queues in order
+    time_t ts;
+    const char* format;
+    int count;
+    log_arg_t arg[LOG_MAX_ARGS];
+} log_slot_t;
+
+// single producer, single consumer: only the owning thread moves tail and
+// only the log process moves head, so a push is a handful of stores
+typedef struct log_queue {
+    _Alignas(LOG_CACHE_LINE) atomic_size_t tail;
+    atomic_size_t dropped;
+    _Alignas(LOG_CACHE_LINE) atomic_size_t head;
+    _Alignas(LOG_CACHE_LINE) log_slot_t slot[LOG_CAPACITY];
+} log_queue_t;
+
+// one queue per logging thread in memory shared with the log process, so no
+// thread ever waits on another one's logging and nothing needs a system call
+typedef struct log_ring {
+    _Alignas(LOG_CACHE_LINE) atomic_int queues_used;
+    atomic_size_t unqueued; // records from threads beyond LOG_QUEUES
+    atomic_size_t dropped;  // every record dropped so far, for the metrics
+    atomic_int terminate;
+    log_queue_t queue[LOG_QUEUES];
+} log_ring_t;
+
+#define LOG_MAGIC "GWLOG01"
+#define LOG_ENTRY_TIME 1
+#define LOG_ENTRY_FORMAT 2
+#define LOG_ENTRY_EVENT 3
+#define LOG_STRING_MAX 255
+
+// a segment is a fixed-size file mapped into the log process and filled with
+// entries; a time entry is written once per second and a format entry the
+// first time a format is used in the segment, so an event only carries its
+// sequence number, format id and arguments, and every segment reads alone
+typedef struct log_segment_header {
+    char magic[8];
+    uint32_t number;
+    uint32_t used;
+} log_segment_header_t;
+
+typedef struct log_entry {
+    uint32_t size; // of the whole entry, a multiple of 8
+    uint16_t type;
+    uint16_t id;   // format id of a format or event entry
+} log_entry_t;
+
+typedef struct log_format {
+    const char* format;
+    char types[LOG_MAX_ARGS + 1]; // i, d or s per argument
+    uint32_t segment;             // segment number + 1 the format was last written to
+} log_format_t;
+
+typedef struct log_writer {
+    int fd;
+    unsigned char* map;
+    uint32_t number;
+    uint32_t used;
+    time_t ts;
+    uint32_t sequence;
+    int format_count;
+    int formats_full; // an event was dropped for want of a format id
+    log_format_t formats[LOG_FORMATS];
+} log_writer_t;
+
+// interned before any other format, so the notice always has an id
+static const char formats_full[] = "%d log formats in use, events of new formats are dropped\n";
+
+static log_queue_t* get_queue(log_ring_t* ring);
+static int drain_ring(log_ring_t* ring);
+static void write_event(const char* format, time_t ts, int count, log_arg_t* args);
+static log_format_t* intern_format(log_writer_t* writer, const char* format);
+static void parse_types(const char* format, char* types);
+static void write_entry(log_writer_t* writer, int type, int id, void* payload, size_t size);
+static void open_segment(log_writer_t* writer);
+static void close_segment(log_writer_t* writer, int truncate);
+static void remove_segments();
+static char* get_segment_name(uint32_t number);
+static log_ring_t** get_ring();
+static log_writer_t* get_writer();
+
+
+void logger_init() {
+
+    log_ring_t** ring = get_ring();
+
+    *ring = mmap(NULL, sizeof(log_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (*ring == MAP_FAILED)
+        ERROR_PRINTF("Unable to map the log queues\n");
+
+    atomic_init( &(*ring)->queues_used, 0 );
+    atomic_init( &(*ring)->unqueued, 0 );
+    atomic_init( &(*ring)->dropped, 0 );
+    atomic_init( &(*ring)->terminate, 0 );
+
+    for (int i = 0; i < LOG_QUEUES; i++) {
+        atomic_init( &(*ring)->queue[i].tail, 0 );
+        atomic_init( &(*ring)->queue[i].head, 0 );
+        atomic_init( &(*ring)->queue[i].dropped, 0 );
+    }
+}
+
+void logger_free() {
+
+    log_ring_t** ring = get_ring();
+
+    munmap(*ring, sizeof(log_ring_t));
+    *ring = NULL;
+}
+
+// a full queue drops the record and counts it rather than making the caller wait
+void log_record(const char* format, int count, log_arg_t* args) {
+
+    log_ring_t* ring = *get_ring();
+    log_queue_t* queue = get_queue(ring);
+    struct timespec now;
+
+    if (queue == NULL) {
+        atomic_fetch_add_explicit( &ring->unqueued, 1, memory_order_relaxed );
+        atomic_fetch_add_explicit( &ring->dropped, 1, memory_order_relaxed );
+        return;
+    }
+
+    size_t tail = atomic_load_explicit( &queue->tail, memory_order_relaxed );
+    if ( tail - atomic_load_explicit( &queue->head, memory_order_acquire ) == LOG_CAPACITY ) {
+        atomic_fetch_add_explicit( &queue->dropped, 1, memory_order_relaxed );
+        atomic_fetch_add_explicit( &ring->dropped, 1, memory_order_relaxed );
+        return;
+    }
+
+    log_slot_t* slot = &queue->slot[tail & LOG_MASK];
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    slot->stamp_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+    slot->ts = time(NULL);
+    slot->format = format;
+    slot->count = count < LOG_MAX_ARGS ? count : LOG_MAX_ARGS;
+    for (int i = 0; i < slot->count; i++)
+        slot->arg[i] = args[i];
+
+    atomic_store_explicit( &queue->tail, tail + 1, memory_order_release );
+}
+
+// a thread claims its queue the first time it logs and keeps it for good
+log_queue_t* get_queue(log_ring_t* ring) {
+
+    static _Thread_local log_queue_t* queue;
+    static _Thread_local int claimed;
+
+    if (claimed == 0) {
+        int index = atomic_fetch_add( &ring->queues_used, 1 );
+        queue = index < LOG_QUEUES ? &ring->queue[index] : NULL;
+        claimed = 1;
+    }
+    return queue;
+}
+
+void logger_stop() {
+
+    atomic_store( &(*get_ring())->terminate, 1 );
+}
+
+size_t logger_get_dropped() {
+
+    return atomic_load_explicit( &(*get_ring())->dropped, memory_order_relaxed );
+}
+
+// the log process is the single consumer of every queue; it runs until the
+// gateway stops it, or exits, and every published record has been written
+void logger_run() {
+
+    log_ring_t* ring = *get_ring();
+    log_writer_t* writer = get_writer();
+    struct timespec poll = { LOG_POLL_MS / 1000, (LOG_POLL_MS % 1000) * 1000000L };
+    pid_t parent = getppid();
+
+    remove_segments();
+    open_segment(writer);
+    intern_format(writer, formats_full);
+
+    for (;;) {
+        if ( drain_ring(ring) > 0 )
+            continue;
+
+        if ( atomic_load( &ring->terminate ) || getppid() != parent )
+            break;
+
+        fflush(stdout);
+        nanosleep(&poll, NULL);
+    }
+
+    drain_ring(ring);
+    close_segment(writer, 1);
+}
+
+// merges the queues by taking the oldest head record until all are empty
+int drain_ring(log_ring_t* ring) {
+
+    int count = 0;
+    int queues = atomic_load( &ring->queues_used );
+
+    if (queues > LOG_QUEUES)
+        queues = LOG_QUEUES;
+
+    for (;;) {
+        log_queue_t* oldest = NULL;
+        log_slot_t* slot = NULL;
+
+        for (int i = 0; i < queues; i++) {
+            log_queue_t* queue = &ring->queue[i];
+            size_t head = atomic_load_explicit( &queue->head, memory_order_relaxed );
+            if ( atomic_load_explicit( &queue->tail, memory_order_acquire ) == head )
+                continue;
+            log_slot_t* candidate = &queue->slot[head & LOG_MASK];
+            if (slot == NULL || candidate->stamp_ns < slot->stamp_ns) {
+                oldest = queue;
+                slot = candidate;
+            }
+        }
+
+        if (oldest == NULL)
+            break;
+
+        write_event(slot->format, slot->ts, slot->count, slot->arg);
+        atomic_fetch_add_explicit( &oldest->head, 1, memory_order_release );
+        count++;
+    }
+
+    for (int i = 0; i < queues; i++) {
+        size_t dropped = atomic_exchange( &ring->queue[i].dropped, 0 );
+        if (dropped > 0)
+            write_event("%zu log messages dropped, log queue %d was full\n", time(NULL), 2,
+                (log_arg_t[]){ LOG_ARG((long long)dropped), LOG_ARG(i) });
+    }
+
+    size_t unqueued = atomic_exchange( &ring->unqueued, 0 );
+    if (unqueued > 0)
+        write_event("%zu log messages dropped, more than %d threads are logging\n", time(NULL), 2,
+            (log_arg_t[]){ LOG_ARG((long long)unqueued), LOG_ARG(LOG_QUEUES) });
+
+    return count;
+}
+
+void write_event(const char* format, time_t ts, int count, log_arg_t* args) {
+
+    log_writer_t* writer = get_writer();
+    unsigned char payload[sizeof(uint32_t) + LOG_MAX_ARGS * (sizeof(uint16_t) + LOG_STRING_MAX + sizeof(log_arg_t))];
+    size_t size = 0;
+
+    log_format_t* entry = intern_format(writer, format);
+    if (entry == NULL) {
+        atomic_fetch_add_explicit( &(*get_ring())->dropped, 1, memory_order_relaxed );
+        if (writer->formats_full == 0) {
+            writer->formats_full = 1;
+            write_event(formats_full, ts, 1, (log_arg_t[]){ LOG_ARG(LOG_FORMATS) });
+        }
+        return;
+    }
+
+    writer->sequence++;
+    memcpy(payload, &writer->sequence, sizeof(uint32_t));
+    size += sizeof(uint32_t);
+
+    // strings are copied in, since the reader cannot follow the pointer
+    for (int i = 0; entry->types[i] != '\0'; i++) {
+        log_arg_t value = i < count ? args[i] : (log_arg_t){ .i = 0 };
+        if (entry->types[i] == 's') {
+            const char* string = value.s != NULL ? value.s : "(null)";
+            uint16_t len = strnlen(string, LOG_STRING_MAX);
+            memcpy(payload + size, &len, sizeof(len));
+            memcpy(payload + size + sizeof(len), string, len);
+            size += sizeof(len) + len;
+        } else {
+            memcpy(payload + size, &value, sizeof(value));
+            size += sizeof(value);
+        }
+    }
+
+    size_t time_size = sizeof(log_entry_t) + sizeof(int64_t);
+    size_t format_size = sizeof(log_entry_t) + sizeof(entry->types) + strlen(format) + 1;
+    size_t needed = sizeof(log_entry_t) + size + 2 * time_size + format_size + 3 * 8;
+
+    if (writer->used + needed > LOG_SEGMENT_SIZE) {
+        close_segment(writer, 0);
+        writer->number++;
+        open_segment(writer);
+    }
+
+    if (ts != writer->ts) {
+        int64_t stamp = ts;
+        write_entry(writer, LOG_ENTRY_TIME, 0, &stamp, sizeof(stamp));
+        writer->ts = ts;
+    }
+
+    if (entry->segment != writer->number + 1) {
+        char definition[sizeof(entry->types) + LOG_LENGTH];
+        size_t len = strnlen(format, LOG_LENGTH - 1);
+        memcpy(definition, entry->types, sizeof(entry->types));
+        memcpy(definition + sizeof(entry->types), format, len);
+        definition[sizeof(entry->types) + len] = '\0';
+        write_entry(writer, LOG_ENTRY_FORMAT, entry - writer->formats, definition, sizeof(entry->types) + len + 1);
+        entry->segment = writer->number + 1;
+    }
+
+    write_entry(writer, LOG_ENTRY_EVENT, entry - writer->formats, payload, size);
+
+#if LOG_ECHO
+    char log_buf[LOG_LENGTH];
+    log_format(format, count, args, log_buf, LOG_LENGTH);
+    printf("\n%s\n", log_buf);
+#endif
+}
+
+// formats are told apart by address, which the fork left the same in both
+// processes, and numbered in the order they are first seen
+log_format_t* intern_format(log_writer_t* writer, const char* format) {
+
+    for (int i = 0; i < writer->format_count; i++)
+        if (writer->formats[i].format == format)
+            return &writer->formats[i];
+
+    if (writer->format_count == LOG_FORMATS)
+        return NULL;
+
+    log_format_t* entry = &writer->formats[writer->format_count++];
+    entry->format = format;
+    entry->segment = 0;
+    parse_types(format, entry->types);
+    return entry;
+}
+
+void parse_types(const char* format, char* types) {
+
+    int count = 0;
+
+    while ( (format = strchr(format, '%')) != NULL && count < LOG_MAX_ARGS ) {
+        format++;
+        if (*format == '%') {
+            format++;
+            continue;
+        }
+        format += strspn(format, "-+ #0123456789.hlLqjzt");
+        if (*format == '\0')
+            break;
+        types[count++] = *format == 's' ? 's' : strchr("fFeEgGaA", *format) != NULL ? 'd' : 'i';
+    }
+    types[count] = '\0';
+}
+
+void write_entry(log_writer_t* writer, int type, int id, void* payload, size_t size) {
+
+    log_entry_t entry = { .size = (sizeof(log_entry_t) + size + 7) & ~(size_t)7, .type = type, .id = id };
+
+    memcpy(writer->map + writer->used, &entry, sizeof(entry));
+    memcpy(writer->map + writer->used + sizeof(entry), payload, size);
+    writer->used += entry.size;
+    ((log_segment_header_t*)writer->map)->used = writer->used;
+}
+
+void open_segment(log_writer_t* writer) {
+
+    char* name = get_segment_name(writer->number);
+
+    writer->fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    SYS_ERR(writer->fd);
+    SYS_ERR( ftruncate(writer->fd, LOG_SEGMENT_SIZE) );
+
+    writer->map = mmap(NULL, LOG_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, writer->fd, 0);
+    if (writer->map == MAP_FAILED)
+        ERROR_PRINTF("Unable to map log segment %s\n", name);
+    free(name);
+
+    log_segment_header_t* header = (log_segment_header_t*)writer->map;
+    memcpy(header->magic, LOG_MAGIC, sizeof(header->magic));
+    header->number = writer->number;
+    writer->used = header->used = sizeof(log_segment_header_t);
+    writer->ts = 0;
+
+    // retention: keep the last LOG_SEGMENTS segments
+    if (writer->number >= LOG_SEGMENTS) {
+        name = get_segment_name(writer->number - LOG_SEGMENTS);
+        unlink(name);
+        free(name);
+    }
+}
+
+void close_segment(log_writer_t* writer, int truncate) {
+
+    munmap(writer->map, LOG_SEGMENT_SIZE);
+    if (truncate)
+        SYS_ERR( ftruncate(writer->fd, writer->used) );
+    close(writer->fd);
+    writer->map = NULL;
+}
+
+// segments of an earlier run would otherwise be mixed with this one's
+void remove_segments() {
+
+    char prefix[] = LOG_NAME ".";
+    struct dirent* file;
+
+    DIR* dir = opendir(".");
+    if (dir == NULL)
+        return;
+
+    while ( (file = readdir(dir)) != NULL )
+        if (strncmp(file->d_name, prefix, sizeof(prefix) - 1) == 0)
+            unlink(file->d_name);
+
+    closedir(dir);
+}
+
+// renders one segment as the text lines the log used to hold
+int log_render(const char* path, FILE* out) {
+
+    struct stat st;
+    char log_buf[LOG_LENGTH], time_buf[20] = "";
+    const char* texts[LOG_FORMATS] = { NULL };
+    const char* types[LOG_FORMATS] = { NULL };
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(log_segment_header_t)) {
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    unsigned char* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    log_segment_header_t* header = (log_segment_header_t*)map;
+    if ( memcmp(header->magic, LOG_MAGIC, sizeof(header->magic)) != 0 || header->used > st.st_size ) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    // a segment left by a crash may end in a torn entry, so every field is
+    // checked against the end of its entry and a bad entry is skipped
+    for (size_t offset = sizeof(log_segment_header_t); offset + sizeof(log_entry_t) <= header->used; ) {
+
+        log_entry_t* entry = (log_entry_t*)(map + offset);
+        unsigned char* payload = map + offset + sizeof(log_entry_t);
+        if (entry->size < sizeof(log_entry_t) || entry->size % 8 != 0 || offset + entry->size > header->used)
+            break;
+        unsigned char* end = map + offset + entry->size;
+        offset += entry->size;
+
+        if (entry->type == LOG_ENTRY_TIME && end - payload >= (long)sizeof(int64_t)) {
+            int64_t stamp;
+            memcpy(&stamp, payload, sizeof(stamp));
+            time_t ts = stamp;
+            struct tm* tm = localtime(&ts);
+            if (tm != NULL)
+                strftime(time_buf, 20, "%Y-%m-%d %X", tm);
+
+        } else if (entry->type == LOG_ENTRY_FORMAT && entry->id < LOG_FORMATS) {
+            const char* text = (const char*)payload + LOG_MAX_ARGS + 1;
+            char parsed[LOG_MAX_ARGS + 1];
+            if ( (unsigned char*)text >= end || memchr(payload, '\0', LOG_MAX_ARGS + 1) == NULL || memchr(text, '\0', end - (unsigned char*)text) == NULL )
+                continue;
+            // a %s read as a number would be followed as a pointer
+            parse_types(text, parsed);
+            if ( strcmp(parsed, (const char*)payload) != 0 )
+                continue;
+            types[entry->id] = (const char*)payload;
+            texts[entry->id] = text;
+
+        } else if (entry->type == LOG_ENTRY_EVENT && entry->id < LOG_FORMATS && texts[entry->id] != NULL) {
+            char strings[LOG_MAX_ARGS][LOG_STRING_MAX + 1];
+            log_arg_t args[LOG_MAX_ARGS];
+            uint32_t sequence;
+            int count = 0, corrupt = 0;
+
+            if (end - payload < (long)sizeof(sequence))
+                continue;
+            memcpy(&sequence, payload, sizeof(sequence));
+            payload += sizeof(sequence);
+
+            for (; types[entry->id][count] != '\0'; count++) {
+                if (types[entry->id][count] == 's') {
+                    uint16_t len;
+                    if (end - payload < (long)sizeof(len)) {
+                        corrupt = 1;
+                        break;
+                    }
+                    memcpy(&len, payload, sizeof(len));
+                    payload += sizeof(len);
+                    if (len > LOG_STRING_MAX || end - payload < len) {
+                        corrupt = 1;
+                        break;
+                    }
+                    memcpy(strings[count], payload, len);
+                    strings[count][len] = '\0';
+                    args[count].s = strings[count];
+                    payload += len;
+                } else {
+                    if (end - payload < (long)sizeof(log_arg_t)) {
+                        corrupt = 1;
+                        break;
+                    }
+                    memcpy(&args[count], payload, sizeof(log_arg_t));
+                    payload += sizeof(log_arg_t);
+                }
+            }
+            if (corrupt)
+                continue;
+
+            log_format(texts[entry->id], count, args, log_buf, LOG_LENGTH);
+            fprintf(out, "%u %s %s", sequence, time_buf, log_buf);
+        }
+    }
+
+    munmap(map, st.st_size);
+    return 0;
+}
+
+// formats one conversion at a time, so every argument is passed to snprintf
+// with the type its conversion expects
+void log_format(const char* format, int count, log_arg_t* args, char* buf, size_t size) {
+
+    size_t len = 0;
+    int arg = 0;
+
+    while (*format != '\0' && len + 1 < size) {
+
+        if (*format != '%' || format[1] == '%') {
+            buf[len++] = *format;
+            format += *format == '%' ? 2 : 1;
+            continue;
+        }
+
+        // copy the flags, width and precision and drop any length modifier
+        char spec[32] = "%";
+        size_t spec_len = 1;
+        format++;
+        while (*format != '\0' && strchr("-+ #0123456789.", *format) != NULL && spec_len < sizeof(spec) - 4)
+            spec[spec_len++] = *format++;
+        while (*format != '\0' && strchr("hlLqjzt", *format) != NULL)
+            format++;
+        if (*format == '\0')
+            break;
+
+        char conversion = *format++;
+        log_arg_t value = arg < count ? args[arg] : (log_arg_t){ .i = 0 };
+        arg++;
+
+        int written;
+        if (strchr("diouxXc", conversion) != NULL) {
+            spec[spec_len++] = 'l';
+            spec[spec_len++] = 'l';
+            spec[spec_len++] = conversion == 'c' ? 'd' : conversion;
+            spec[spec_len] = '\0';
+            if (conversion == 'c')
+                written = snprintf(buf + len, size - len, "%c", (int)value.i);
+            else
+                written = snprintf(buf + len, size - len, spec, value.i);
+        } else if (strchr("fFeEgGaA", conversion) != NULL) {
+            spec[spec_len++] = conversion;
+            spec[spec_len] = '\0';
+            written = snprintf(buf + len, size - len, spec, value.d);
+        } else if (conversion == 's') {
+            spec[spec_len++] = conversion;
+            spec[spec_len] = '\0';
+            written = snprintf(buf + len, size - len, spec, value.s != NULL ? value.s : "(null)");
+        } else {
+            written = 0;
+        }
+
+        if (written > 0)
+            len += (size_t)written < size - len ? (size_t)written : size - len - 1;
+    }
+
+    buf[len] = '\0';
+}
+
+char* get_segment_name(uint32_t number) {
+
+    char* name;
+    ASPRINTF_ERR( asprintf(&name, "%s.%06u", LOG_NAME, number) );
+    return name;
+}
+
+log_ring_t** get_ring() {
+
+    static log_ring_t* ring;
+    return &ring;
+}
+
+log_writer_t* get_writer() {
+
+    static log_writer_t writer;
+    return &writer;
+}
@@ -0,0 +1,67 @@
+#ifndef _LOGGER_H_
+#define _LOGGER_H_
+
+#include <stdio.h>
+#include <time.h>
+
+#ifndef LOG_CAPACITY
+  #define LOG_CAPACITY 1024 // records in each thread's log queue, must be a power of two
+#endif
+
+#ifndef LOG_QUEUES
+  #define LOG_QUEUES 64 // threads that can log, each gets its own queue
+#endif
+
+#ifndef LOG_POLL_MS
+  #define LOG_POLL_MS 10 // how long the log process sleeps when all queues are empty
+#endif
+
+#ifndef LOG_SEGMENT_SIZE
+  #define LOG_SEGMENT_SIZE (1 << 20) // bytes per gateway.log.NNNNNN segment
+#endif
+
+#ifndef LOG_SEGMENTS
+  #define LOG_SEGMENTS 8 // segments kept, older ones are deleted on rotation
+#endif
+
+#ifndef LOG_ECHO
+  #define LOG_ECHO 1 // set to 0 to stop the log process printing every message
+#endif
+
+#define LOG_MAX_ARGS 4
+#define LOG_FORMATS 256 // distinct log formats a run can use
+
+#if (LOG_CAPACITY & (LOG_CAPACITY - 1)) != 0
+    #error LOG_CAPACITY must be a power of two
+#endif
+
+// a log argument is kept in binary and only formatted by the log process,
+// which reads its type off the conversion in the format string
+typedef union {
+    long long i;
+    double d;
+    const char* s;
+} log_arg_t;
+
+static inline log_arg_t log_arg_int(long long i) { return (log_arg_t){ .i = i }; }
+static inline log_arg_t log_arg_double(double d) { return (log_arg_t){ .d = d }; }
+static inline log_arg_t log_arg_string(const char* s) { return (log_arg_t){ .s = s }; }
+
+#define LOG_ARG(x) _Generic((x), \
+    float: log_arg_double, \
+    double: log_arg_double, \
+    char*: log_arg_string, \
+    const char*: log_arg_string, \
+    default: log_arg_int)(x)
+
+void logger_init();
+void logger_free();
+void logger_run();
+void logger_stop();
+size_t logger_get_dropped();
+void log_record(const char* format, int count, log_arg_t* args);
+void log_format(const char* format, int count, log_arg_t* args, char* buf, size_t size);
+int log_render(const char* path, FILE* out);
+
+
+#endif /* _LOGGER_H_ */
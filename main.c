@@ -16,139 +16,127 @@
 #include "connmgr.h"
 #include "datamgr.h"
 #include "sensor_db.h"
+#include "metrics.h"
 #include "errmacros.h"
 
-typedef struct var {
+typedef struct shard {
     sbuffer_t* buffer;
-    int port_number;
-} var_t;
-
-typedef struct fifo {
-    FILE* fp;
-    pthread_mutex_t key;
-} fifo_t;
-
-static void run_main_process(int* port_number, int* pipe_fd);
-static void run_log_process(int* pipe_fd);
-static void* connmgr(void* port_number);
-static void* datamgr(void* null);
-static void* strmgr(void* null);
-static void try_connect(DBCONN* db, sbuffer_t* buffer);
+    int id;
+} shard_t;
+
+static void run_main_process(int* port_number);
+static void run_log_process();
+static void* connmgr(void* mgr);
+static void* datamgr(void* shard);
+static void* strmgr(void* partition);
+static void try_connect(DBCONN* db, sbuffer_t* buffer, int partition);
 static void start_gateway(sbuffer_t* buffer);
 static void kill_gateway(sbuffer_t* buffer);
 static void print_help();
-static fifo_t* get_fifo();
 
 
 int main( int argc, char *argv[] ) {
 
-    int port_number, pipe_fd[2];
+    int port_number, option;
+
+    while ((option = getopt(argc, argv, "w:p:")) != -1) {
+        switch (option) {
+            case 'w':
+                if (atoi(optarg) < 1)
+                    print_help();
+                datamgr_set_window(atoi(optarg));
+                break;
+            case 'p':
+                if (db_set_profile(optarg) != 0)
+                    print_help();
+                break;
+            default:
+                print_help();
+        }
+    }
 
-    if (argc != 2)
+    if (optind != argc - 1)
         print_help();
 
-    port_number = atoi(argv[1]);
+    port_number = atoi(argv[optind]);
 
-    remove(FIFO_NAME);
-    MKFIFO_ERR( mkfifo(FIFO_NAME, 0666) );
-    SYS_ERR( pipe(pipe_fd) );
+    logger_init();
 
     pid_t log_pid = fork();
     SYS_ERR(log_pid);
 
     if (log_pid != 0)
-        run_main_process(&port_number, pipe_fd);
+        run_main_process(&port_number);
     else
-        run_log_process(pipe_fd);
+        run_log_process();
+
+    logger_free();
 
     return 0;
 }
 
-void run_main_process(int* port_number, int* pipe_fd) {
+void run_main_process(int* port_number) {
 
     DEBUG_PRINTF("Main process is starting...\n");
 
     sbuffer_t* buffer;
-    pthread_t connmgr_id, datamgr_id, strmgr_id;
-
-    close(pipe_fd[0]);
-
-    fifo_t* fifo = get_fifo();
-    fifo->fp = fopen(FIFO_NAME, "w");
-    FILE_OPEN_ERR(fifo->fp, FIFO_NAME);
-    PTHR_ERR( pthread_mutex_init( &fifo->key, NULL ) );
+    pthread_t connmgr_id[CONNMGR_WORKERS], datamgr_id[DATAMGR_WORKERS], strmgr_id[STRMGR_WRITERS];
+    shard_t shard[DATAMGR_WORKERS], partition[STRMGR_WRITERS];
 
     SBUFFER_ERR( sbuffer_init(&buffer) );
-    PTHR_ERR( pthread_create(&strmgr_id, NULL, &strmgr, buffer) );
+    metrics_start(buffer);
+    for (int writer = 0; writer < STRMGR_WRITERS; writer++) {
+        partition[writer].buffer = buffer;
+        partition[writer].id = writer;
+        PTHR_ERR( pthread_create(&strmgr_id[writer], NULL, &strmgr, &partition[writer]) );
+    }
     BARRIER_ERR( pthread_barrier_wait( &buffer->pthr.barrier) );
 
-    if ( buffer->num.initialize ) {
+    if ( buffer->num.initialize == STRMGR_WRITERS ) {
 
-        var_t* var = malloc(sizeof(var_t));
-        ALLOC_ERR(var);
-        var->buffer = buffer;
-        var->port_number = *port_number;
+        for (int worker = 0; worker < CONNMGR_WORKERS; worker++) {
+            connmgr_t* mgr = connmgr_init(*port_number, buffer);
+            PTHR_ERR( pthread_create(&connmgr_id[worker], NULL, &connmgr, mgr) );
+        }
 
-        PTHR_ERR( pthread_create(&connmgr_id, NULL, &connmgr, var) );
-        PTHR_ERR( pthread_create(&datamgr_id, NULL, &datamgr, buffer) );
+        FILE* fp_map = fopen(MAP_NAME, "r");
+        FILE_OPEN_ERR(fp_map, MAP_NAME);
+        datamgr_init(fp_map);
+        fclose(fp_map);
+        FILE_CLOSE_ERR(fp_map, MAP_NAME);
 
-        PTHR_ERR( pthread_join(connmgr_id, NULL) );
-        kill_gateway(buffer);
-        PTHR_ERR( pthread_join(datamgr_id, NULL) );
+        for (int worker = 0; worker < DATAMGR_WORKERS; worker++) {
+            shard[worker].buffer = buffer;
+            shard[worker].id = worker;
+            PTHR_ERR( pthread_create(&datamgr_id[worker], NULL, &datamgr, &shard[worker]) );
+        }
 
-        free(var);
+        for (int worker = 0; worker < CONNMGR_WORKERS; worker++)
+            PTHR_ERR( pthread_join(connmgr_id[worker], NULL) );
+        kill_gateway(buffer);
+        for (int worker = 0; worker < DATAMGR_WORKERS; worker++)
+            PTHR_ERR( pthread_join(datamgr_id[worker], NULL) );
+        datamgr_free();
+    } else {
+        kill_gateway(buffer);
     }
 
-    PTHR_ERR( pthread_join(strmgr_id, NULL) );
+    for (int writer = 0; writer < STRMGR_WRITERS; writer++)
+        PTHR_ERR( pthread_join(strmgr_id[writer], NULL) );
+    metrics_stop();
     SBUFFER_ERR( sbuffer_free(&buffer) );
 
-    fclose(fifo->fp);
-    FILE_CLOSE_ERR(fifo->fp , FIFO_NAME);
-    PTHR_ERR( pthread_mutex_destroy( &fifo->key ) );
-    free(fifo);
-
-    int kill_log = 1;
-    write(pipe_fd[1], &kill_log, sizeof(kill_log));
-    close(pipe_fd[1]);
-
+    logger_stop();
     SYS_ERR( wait(NULL) );
 
     DEBUG_PRINTF("Main process is exiting...\n");
 }
 
-void run_log_process(int* pipe_fd) {
+void run_log_process() {
 
     DEBUG_PRINTF("Log process is starting...\n");
 
-    char log_buf[LOG_LENGTH], time_buf[20];
-    int sequence = 0, kill_log = 0;
-
-    close(pipe_fd[1]);
-
-    FILE* fp_fifo = fopen(FIFO_NAME, "r");
-    FILE_OPEN_ERR(fp_fifo, FIFO_NAME);
-
-    FILE* fp_log = fopen(LOG_NAME, "w");
-    FILE_OPEN_ERR(fp_log, LOG_NAME);
-
-    while (kill_log == 0) {
-        if (fgets(log_buf, LOG_LENGTH, fp_fifo) != NULL) {
-            sequence++;
-            time_t cur_time = time(NULL);
-            strftime(time_buf, 20, "%Y-%m-%d %X", localtime(&cur_time));
-            fprintf(fp_log, "%d %s %s", sequence, time_buf, log_buf);
-        } else {
-            read(pipe_fd[0], &kill_log, sizeof(kill_log));
-        }
-    }
-
-    close(pipe_fd[0]);
-
-    fclose(fp_log);
-    FILE_CLOSE_ERR(fp_log, LOG_NAME);
-
-    fclose(fp_fifo);
-    FILE_CLOSE_ERR(fp_fifo, FIFO_NAME);
+    logger_run();
 
     DEBUG_PRINTF("Log process is exiting...\n");
 }
@@ -157,10 +145,11 @@ void* connmgr(void* ptr) {
 
     DEBUG_PRINTF("Connmgr thread is starting...\n");
 
-    var_t* var = (var_t*)ptr;
+    connmgr_t* mgr = (connmgr_t*)ptr;
+    metrics_register("connmgr", -1);
 
-    connmgr_listen(var->port_number, &var->buffer);
-    connmgr_free();
+    connmgr_listen(mgr);
+    connmgr_free(&mgr);
 
     DEBUG_PRINTF("Connmgr thread is exiting...\n");
     pthread_exit(NULL);
@@ -170,16 +159,10 @@ void* datamgr(void* ptr) {
 
     DEBUG_PRINTF("Datamgr thread is starting...\n");
 
-    sbuffer_t* buffer = (sbuffer_t*)ptr;
-
-    FILE* fp_map = fopen(MAP_NAME, "r");
-    FILE_OPEN_ERR(fp_map, MAP_NAME);
+    shard_t* shard = (shard_t*)ptr;
+    metrics_register("datamgr", shard->id);
 
-    datamgr_parse_sensor_data(fp_map, &buffer);
-    datamgr_free();
-
-    fclose(fp_map);
-    FILE_CLOSE_ERR(fp_map, MAP_NAME);
+    datamgr_parse_sensor_data(&shard->buffer, shard->id);
 
     DEBUG_PRINTF("Datamgr thread is exiting...\n");
     pthread_exit(NULL);
@@ -189,11 +172,13 @@ void* strmgr(void* ptr) {
 
     DEBUG_PRINTF("Strmgr thread is starting...\n");
 
-    sbuffer_t* buffer = (sbuffer_t*)ptr;
+    shard_t* partition = (shard_t*)ptr;
+    sbuffer_t* buffer = partition->buffer;
+    metrics_register("strmgr", partition->id);
 
     DBCONN* db = NULL;
     for (int attempt = 0; attempt < SQL_ATTEMPT; attempt++) {
-        try_connect(db, buffer);
+        try_connect(db, buffer, partition->id);
         LOG_PRINTF("Trying to connect to SQL server... Attempt %d\n", attempt + 1);
     }
 
@@ -205,16 +190,16 @@ void* strmgr(void* ptr) {
     pthread_exit(NULL);
 }
 
-void try_connect(DBCONN* db, sbuffer_t* buffer) {
+void try_connect(DBCONN* db, sbuffer_t* buffer, int partition) {
 
     time_t start_time = time(NULL);
     time_t current_time = start_time;
 
     while (current_time - start_time <= TIMEOUT) {
-        db = init_connection(CLEAR_DATABASE);
+        db = init_connection(CLEAR_DATABASE, partition);
         if (db != NULL) {
             start_gateway(buffer);
-            storagemgr_parse_sensor_data(db, &buffer);
+            storagemgr_parse_sensor_data(db, &buffer, partition);
             disconnect(db);
             DEBUG_PRINTF("Strmgr thread exiting...\n");
             pthread_exit(NULL);
@@ -225,7 +210,9 @@ void try_connect(DBCONN* db, sbuffer_t* buffer) {
 
 void start_gateway(sbuffer_t* buffer) {
 
-    buffer->num.initialize = 1;
+    PTHR_ERR( pthread_mutex_lock( &buffer->pthr.main_key ) );
+    buffer->num.initialize++;
+    PTHR_ERR( pthread_mutex_unlock( &buffer->pthr.main_key ) );
     DEBUG_PRINTF("Signal to start all threads sent...\n");
 
     BARRIER_ERR( pthread_barrier_wait( &buffer->pthr.barrier) );
@@ -242,31 +229,10 @@ void kill_gateway(sbuffer_t* buffer) {
     PTHR_ERR( pthread_mutex_unlock ( &buffer->pthr.main_key ) );
 }
 
-fifo_t* get_fifo() {
-
-    static fifo_t* fifo;
-    if (fifo == NULL) {
-        fifo = malloc(sizeof(fifo_t));
-        ALLOC_ERR(fifo);
-    }
-    return fifo;
-}
-
-void log_write(char* log) {
-
-    fifo_t* fifo = get_fifo();
-
-    PTHR_ERR( pthread_mutex_lock( &fifo->key ) );
-
-    printf("\n%s\n", log);
-    fputs(log, fifo->fp);
-    fflush(fifo->fp);
-
-    PTHR_ERR( pthread_mutex_unlock( &fifo->key ) );
-}
-
 void print_help() {
-    printf("Use this program with 2 command line options: \n");
+    printf("Use this program with the following command line options: \n");
     printf("\t%-15s : a unique port number\n", "\'PORT\'");
+    printf("\t%-15s : running statistics window in samples (default %d)\n", "\'-w WINDOW\'", RUN_AVG_LENGTH);
+    printf("\t%-15s : storage profile journal, wal or fast (default journal)\n", "\'-p PROFILE\'");
     exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,335 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "errmacros.h"
+
+#define METRICS_STAGE_LENGTH 16
+#define METRICS_SUB (1 << METRICS_SUB_BITS)
+#define METRICS_BUCKETS ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) * METRICS_SUB)
+
+typedef struct metrics_histogram {
+    atomic_ulong bucket[METRICS_BUCKETS];
+    atomic_ulong count;
+    atomic_ulong sum_ns;
+} metrics_histogram_t;
+
+typedef struct metrics_block {
+    _Alignas(SBUFFER_CACHE_LINE) atomic_ulong value[METRIC_COUNT];
+    char stage[METRICS_STAGE_LENGTH];
+    int id; // shard, partition or worker number within its stage
+    metrics_histogram_t latency[LATENCY_COUNT];
+} metrics_block_t;
+
+typedef struct metrics {
+    metrics_block_t block[METRICS_THREADS];
+    metrics_block_t shared; // threads that never registered, or came too late
+    atomic_int used;
+    sbuffer_t* buffer;
+    pthread_t exporter;
+    pthread_mutex_t key;
+    pthread_cond_t wake;
+    int stop;
+} metrics_t;
+
+typedef struct metric_info {
+    char* name;
+    char* help;
+    char* stage; // a series is written for every thread of this stage
+} metric_info_t;
+
+static char* latency_stages[LATENCY_COUNT] = { "datamgr", "commit" };
+static double latency_quantiles[] = { 0.5, 0.99, 0.999 };
+
+static metric_info_t metric_info[METRIC_COUNT] = {
+    [METRIC_CONNECTIONS] = { "gateway_connections_total", "Sensor connections accepted.", "connmgr" },
+    [METRIC_READINGS_RECEIVED] = { "gateway_readings_received_total", "Readings decoded off sensor sockets.", "connmgr" },
+    [METRIC_WAKEUPS] = { "gateway_wakeups_total", "Returns from poll or epoll_wait.", "connmgr" },
+    [METRIC_THROTTLES] = { "gateway_throttles_total", "Times reading stopped at the buffer high watermark.", "connmgr" },
+    [METRIC_THROTTLED_MS] = { "gateway_throttled_ms_total", "Milliseconds spent not reading sensor sockets.", "connmgr" },
+    [METRIC_READINGS_PROCESSED] = { "gateway_readings_processed_total", "Readings of known sensors handled by the data manager.", "datamgr" },
+    [METRIC_READINGS_INVALID] = { "gateway_readings_invalid_total", "Readings of sensor ids missing from the room map.", "datamgr" },
+    [METRIC_DB_COMMITS] = { "gateway_db_commits_total", "SQLite transactions committed.", "strmgr" },
+    [METRIC_DB_ROWS] = { "gateway_db_rows_total", "Rows committed to SQLite.", "strmgr" },
+    [METRIC_DB_SPILLED] = { "gateway_db_spilled_total", "Rows appended to the spill journal.", "strmgr" },
+};
+
+static _Thread_local metrics_block_t* thread_block;
+
+static void* run_exporter(void* metrics);
+static void write_metrics(metrics_t* metrics);
+static void write_series(FILE* fp, char* name, metrics_block_t* block, unsigned long value);
+static void write_latency(FILE* fp, metrics_t* metrics, int used, latency_t latency);
+static void histogram_add(metrics_histogram_t* histogram, uint64_t ns, int shared);
+static int get_bucket(uint64_t ns);
+static uint64_t get_bucket_value(int bucket);
+static metrics_t* get_metrics();
+
+
+// gives the calling thread counters of its own; a negative id numbers it
+// after the threads of its stage registered so far, and a thread taking over
+// the stage and id of one that has exited carries on with its counters, so
+// every series is written once
+void metrics_register(const char* stage, int id) {
+
+    metrics_t* metrics = get_metrics();
+
+    PTHR_ERR( pthread_mutex_lock( &metrics->key ) );
+    int used = atomic_load( &metrics->used );
+
+    for (int i = 0; i < used && id >= 0; i++) {
+        if (metrics->block[i].id == id && strncmp(metrics->block[i].stage, stage, METRICS_STAGE_LENGTH - 1) == 0) {
+            thread_block = &metrics->block[i];
+            PTHR_ERR( pthread_mutex_unlock( &metrics->key ) );
+            return;
+        }
+    }
+
+    if (used < METRICS_THREADS) {
+        if (id < 0) {
+            id = 0;
+            for (int i = 0; i < used; i++)
+                if (strcmp(metrics->block[i].stage, stage) == 0)
+                    id++;
+        }
+
+        metrics_block_t* block = &metrics->block[used];
+        snprintf(block->stage, METRICS_STAGE_LENGTH, "%s", stage);
+        block->id = id;
+        thread_block = block;
+        atomic_store( &metrics->used, used + 1 );
+    }
+    PTHR_ERR( pthread_mutex_unlock( &metrics->key ) );
+}
+
+void metrics_add(metric_t metric, unsigned long count) {
+
+    metrics_block_t* block = thread_block;
+
+    if (block == NULL) {
+        atomic_fetch_add_explicit( &get_metrics()->shared.value[metric], count, memory_order_relaxed );
+        return;
+    }
+
+    // the owner is the only writer, so no locked read-modify-write is needed
+    unsigned long value = atomic_load_explicit( &block->value[metric], memory_order_relaxed );
+    atomic_store_explicit( &block->value[metric], value + count, memory_order_relaxed );
+}
+
+// one clock read covers the whole batch, readings without a stamp are skipped
+void metrics_latency(latency_t latency, sensor_data_t* data, int count) {
+
+    metrics_block_t* block = thread_block;
+    metrics_histogram_t* histogram = block != NULL ? &block->latency[latency] : &get_metrics()->shared.latency[latency];
+    int64_t now = metrics_now_ns();
+
+    for (int i = 0; i < count; i++)
+        if (data[i].ingest_ns != 0)
+            histogram_add(histogram, now > data[i].ingest_ns ? now - data[i].ingest_ns : 0, block == NULL);
+}
+
+int64_t metrics_now_ns() {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void metrics_start(sbuffer_t* buffer) {
+
+    metrics_t* metrics = get_metrics();
+
+    metrics->buffer = buffer;
+    metrics->stop = 0;
+
+    pthread_condattr_t attr;
+    PTHR_ERR( pthread_condattr_init( &attr ) );
+    PTHR_ERR( pthread_condattr_setclock( &attr, CLOCK_MONOTONIC ) );
+    PTHR_ERR( pthread_cond_init( &metrics->wake, &attr ) );
+    PTHR_ERR( pthread_condattr_destroy( &attr ) );
+    PTHR_ERR( pthread_create( &metrics->exporter, NULL, &run_exporter, metrics ) );
+}
+
+// writes the counters a last time, so the file holds the totals of the run
+void metrics_stop() {
+
+    metrics_t* metrics = get_metrics();
+
+    PTHR_ERR( pthread_mutex_lock( &metrics->key ) );
+    metrics->stop = 1;
+    PTHR_ERR( pthread_cond_signal( &metrics->wake ) );
+    PTHR_ERR( pthread_mutex_unlock( &metrics->key ) );
+
+    PTHR_ERR( pthread_join( metrics->exporter, NULL ) );
+    PTHR_ERR( pthread_cond_destroy( &metrics->wake ) );
+    write_metrics(metrics);
+}
+
+void* run_exporter(void* ptr) {
+
+    metrics_t* metrics = (metrics_t*)ptr;
+    struct timespec deadline;
+
+    PTHR_ERR( pthread_mutex_lock( &metrics->key ) );
+    while (metrics->stop == 0) {
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += METRICS_INTERVAL_MS / 1000;
+        deadline.tv_nsec += (METRICS_INTERVAL_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        if ( pthread_cond_timedwait( &metrics->wake, &metrics->key, &deadline ) == 0 )
+            continue;
+
+        PTHR_ERR( pthread_mutex_unlock( &metrics->key ) );
+        write_metrics(metrics);
+        PTHR_ERR( pthread_mutex_lock( &metrics->key ) );
+    }
+    PTHR_ERR( pthread_mutex_unlock( &metrics->key ) );
+
+    return NULL;
+}
+
+// the file is written aside and renamed over the old one, so a scraper
+// never reads half of it
+void write_metrics(metrics_t* metrics) {
+
+    int used = atomic_load( &metrics->used );
+    sbuffer_t* buffer = metrics->buffer;
+
+    FILE* fp = fopen(METRICS_NAME ".tmp", "w");
+    if (fp == NULL) {
+        perror("Unable to write " METRICS_NAME);
+        return;
+    }
+
+    for (int metric = 0; metric < METRIC_COUNT; metric++) {
+        metric_info_t* info = &metric_info[metric];
+        fprintf(fp, "# HELP %s %s\n# TYPE %s counter\n", info->name, info->help, info->name);
+
+        // a thread of another stage is only listed when it counted something
+        for (int i = 0; i < used; i++) {
+            unsigned long value = atomic_load_explicit( &metrics->block[i].value[metric], memory_order_relaxed );
+            if (value > 0 || strcmp(metrics->block[i].stage, info->stage) == 0)
+                write_series(fp, info->name, &metrics->block[i], value);
+        }
+
+        unsigned long value = atomic_load_explicit( &metrics->shared.value[metric], memory_order_relaxed );
+        if (value > 0)
+            fprintf(fp, "%s{stage=\"shared\"} %lu\n", info->name, value);
+    }
+
+    fprintf(fp, "# HELP gateway_latency_seconds Time from the socket read of a reading to the stage.\n"
+        "# TYPE gateway_latency_seconds summary\n");
+    for (int latency = 0; latency < LATENCY_COUNT; latency++)
+        write_latency(fp, metrics, used, latency);
+
+    fprintf(fp, "# HELP gateway_sbuffer_backlog Readings in the buffer a thread has not got to yet.\n"
+        "# TYPE gateway_sbuffer_backlog gauge\n");
+    for (int reader = 0; reader < DATAMGR_WORKERS; reader++)
+        fprintf(fp, "gateway_sbuffer_backlog{stage=\"datamgr\",thread=\"%d\"} %zu\n", reader, sbuffer_available(buffer, reader));
+    for (int writer = 0; writer < STRMGR_WRITERS; writer++)
+        fprintf(fp, "gateway_sbuffer_backlog{stage=\"strmgr\",thread=\"%d\"} %zu\n", writer, sbuffer_available(buffer, SBUFFER_HEAD(writer)));
+
+    fprintf(fp, "# HELP gateway_sbuffer_size Readings in the buffer.\n# TYPE gateway_sbuffer_size gauge\n"
+        "gateway_sbuffer_size %zu\n", sbuffer_size(buffer));
+    fprintf(fp, "# HELP gateway_sbuffer_capacity Slots of the buffer.\n# TYPE gateway_sbuffer_capacity gauge\n"
+        "gateway_sbuffer_capacity %d\n", SBUFFER_CAPACITY);
+    fprintf(fp, "# HELP gateway_log_dropped_total Log messages dropped on full log queues or a full format table.\n# TYPE gateway_log_dropped_total counter\n"
+        "gateway_log_dropped_total %zu\n", logger_get_dropped());
+
+    if ( fclose(fp) != 0 || rename(METRICS_NAME ".tmp", METRICS_NAME) != 0 )
+        perror("Unable to write " METRICS_NAME);
+}
+
+void write_series(FILE* fp, char* name, metrics_block_t* block, unsigned long value) {
+
+    fprintf(fp, "%s{stage=\"%s\",thread=\"%d\"} %lu\n", name, block->stage, block->id, value);
+}
+
+// the histograms of all threads are merged, and a quantile is reported as
+// the highest value of the bucket it falls in, so it is never understated
+void write_latency(FILE* fp, metrics_t* metrics, int used, latency_t latency) {
+
+    static unsigned long bucket[METRICS_BUCKETS];
+    unsigned long count = 0, sum_ns = 0;
+
+    memset(bucket, 0, sizeof(bucket));
+    for (int i = 0; i <= used; i++) {
+        metrics_histogram_t* histogram = i < used ? &metrics->block[i].latency[latency] : &metrics->shared.latency[latency];
+        for (int b = 0; b < METRICS_BUCKETS; b++)
+            bucket[b] += atomic_load_explicit( &histogram->bucket[b], memory_order_relaxed );
+        count += atomic_load_explicit( &histogram->count, memory_order_relaxed );
+        sum_ns += atomic_load_explicit( &histogram->sum_ns, memory_order_relaxed );
+    }
+
+    for (int q = 0; q < sizeof(latency_quantiles) / sizeof(latency_quantiles[0]); q++) {
+        unsigned long rank = (unsigned long)(latency_quantiles[q] * count), seen = 0;
+        int b = 0;
+        while (b < METRICS_BUCKETS - 1 && (seen += bucket[b]) <= rank)
+            b++;
+        fprintf(fp, "gateway_latency_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n",
+            latency_stages[latency], latency_quantiles[q], count > 0 ? get_bucket_value(b) / 1e9 : 0.0);
+    }
+    fprintf(fp, "gateway_latency_seconds_sum{stage=\"%s\"} %.9f\n", latency_stages[latency], sum_ns / 1e9);
+    fprintf(fp, "gateway_latency_seconds_count{stage=\"%s\"} %lu\n", latency_stages[latency], count);
+}
+
+void histogram_add(metrics_histogram_t* histogram, uint64_t ns, int shared) {
+
+    int bucket = get_bucket(ns);
+
+    if (shared) {
+        atomic_fetch_add_explicit( &histogram->bucket[bucket], 1, memory_order_relaxed );
+        atomic_fetch_add_explicit( &histogram->count, 1, memory_order_relaxed );
+        atomic_fetch_add_explicit( &histogram->sum_ns, ns, memory_order_relaxed );
+        return;
+    }
+
+    unsigned long value = atomic_load_explicit( &histogram->bucket[bucket], memory_order_relaxed );
+    atomic_store_explicit( &histogram->bucket[bucket], value + 1, memory_order_relaxed );
+    value = atomic_load_explicit( &histogram->count, memory_order_relaxed );
+    atomic_store_explicit( &histogram->count, value + 1, memory_order_relaxed );
+    value = atomic_load_explicit( &histogram->sum_ns, memory_order_relaxed );
+    atomic_store_explicit( &histogram->sum_ns, value + ns, memory_order_relaxed );
+}
+
+// below METRICS_SUB every value has its bucket, above it the top
+// METRICS_SUB_BITS + 1 bits of the value pick one
+int get_bucket(uint64_t ns) {
+
+    if (ns < METRICS_SUB)
+        return (int)ns;
+    if (ns >= 1ULL << METRICS_MAX_BITS)
+        return METRICS_BUCKETS - 1;
+
+    int shift = 63 - __builtin_clzll(ns) - METRICS_SUB_BITS;
+    return (shift + 1) * METRICS_SUB + (int)(ns >> shift) - METRICS_SUB;
+}
+
+uint64_t get_bucket_value(int bucket) {
+
+    if (bucket < METRICS_SUB)
+        return bucket;
+
+    int shift = bucket / METRICS_SUB - 1;
+    return ((uint64_t)(METRICS_SUB + bucket % METRICS_SUB + 1) << shift) - 1;
+}
+
+metrics_t* get_metrics() {
+
+    // threads may register before metrics_start(), so the lock is static
+    static metrics_t metrics = { .key = PTHREAD_MUTEX_INITIALIZER };
+    return &metrics;
+}
@@ -0,0 +1,57 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "sbuffer.h"
+
+#ifndef METRICS_INTERVAL_MS
+  #define METRICS_INTERVAL_MS 1000 // how often the counters are summed into METRICS_NAME
+#endif
+
+#ifndef METRICS_THREADS
+  #define METRICS_THREADS 64 // threads with counters of their own, later ones share one set
+#endif
+
+#ifndef METRICS_SUB_BITS
+  #define METRICS_SUB_BITS 4 // latency buckets per power of two as a power of two, 4 is within 1/16
+#endif
+
+#ifndef METRICS_MAX_BITS
+  #define METRICS_MAX_BITS 40 // latencies are capped at 2^40 ns, about 18 minutes
+#endif
+
+// every counter is only written by the thread that owns it, so counting is a
+// plain load and store to a cache line no other thread writes; an exporter
+// thread sums them every METRICS_INTERVAL_MS together with the buffer depths
+// and log drops, and replaces METRICS_NAME with the text exposition format
+typedef enum {
+    METRIC_CONNECTIONS,        // connmgr: connections accepted
+    METRIC_READINGS_RECEIVED,  // connmgr: readings decoded off sensor sockets
+    METRIC_WAKEUPS,            // connmgr: returns from poll or epoll_wait
+    METRIC_THROTTLES,          // connmgr: times reading stopped at the high watermark
+    METRIC_THROTTLED_MS,       // connmgr: time spent not reading
+    METRIC_READINGS_PROCESSED, // datamgr: readings of known sensors
+    METRIC_READINGS_INVALID,   // datamgr: readings of ids missing from the room map
+    METRIC_DB_COMMITS,         // strmgr: transactions committed
+    METRIC_DB_ROWS,            // strmgr: rows committed
+    METRIC_DB_SPILLED,         // strmgr: rows appended to the spill journal
+    METRIC_COUNT
+} metric_t;
+
+// latency of a reading from the socket read that completed it (ingest_ns)
+// to a stage, kept in log-linear buckets like an HDR histogram: exact below
+// 2^METRICS_SUB_BITS ns, then 2^METRICS_SUB_BITS buckets per power of two
+typedef enum {
+    LATENCY_DATAMGR, // processed by the data manager
+    LATENCY_COMMIT,  // committed to SQLite
+    LATENCY_COUNT
+} latency_t;
+
+void metrics_register(const char* stage, int id);
+void metrics_add(metric_t metric, unsigned long count);
+void metrics_latency(latency_t latency, sensor_data_t* data, int count);
+int64_t metrics_now_ns();
+void metrics_start(sbuffer_t* buffer);
+void metrics_stop();
+
+
+#endif /* _METRICS_H_ */
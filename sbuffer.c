@@ -5,28 +5,43 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "sbuffer.h"
 #include "errmacros.h"
 
+#define SBUFFER_MASK (SBUFFER_CAPACITY - 1)
+
+static size_t sbuffer_min(sbuffer_cursor_t* cursor, int count);
+static void sbuffer_wait_not_full(sbuffer_t* buffer, size_t tail);
+static void sbuffer_wake(sbuffer_t* buffer, sbuffer_cursor_t* waiters, pthread_cond_t* cond);
+
+
 int sbuffer_init(sbuffer_t** buffer) {
 
-    *buffer = malloc(sizeof(sbuffer_t));
-    if (*buffer == NULL)
+    if ( posix_memalign( (void**)buffer, SBUFFER_CACHE_LINE, sizeof(sbuffer_t) ) != 0 )
         return SBUFFER_FAILURE;
 
-    (*buffer)->head = NULL;
-    (*buffer)->mid = NULL;
-    (*buffer)->tail = NULL;
+    for (int writer = 0; writer < STRMGR_WRITERS; writer++)
+        atomic_init( &(*buffer)->head[writer].pos, 0 );
+    for (int reader = 0; reader < DATAMGR_WORKERS; reader++)
+        atomic_init( &(*buffer)->mid[reader].pos, 0 );
+    atomic_init( &(*buffer)->tail.pos, 0 );
+    atomic_init( &(*buffer)->sleepers.pos, 0 );
+    atomic_init( &(*buffer)->blocked.pos, 0 );
 
     (*buffer)->num.initialize = 0;
     (*buffer)->num.terminate = 0;
 
+    pthread_condattr_t attr;
+    PTHR_ERR( pthread_condattr_init( &attr ) );
+    PTHR_ERR( pthread_condattr_setclock( &attr, CLOCK_MONOTONIC ) );
     PTHR_ERR( pthread_mutex_init( &(*buffer)->pthr.main_key, NULL ) );
     PTHR_ERR( pthread_mutex_init( &(*buffer)->pthr.write_key, NULL ) );
-    PTHR_ERR( pthread_cond_init( &(*buffer)->pthr.buffer_not_empty, NULL ) );
-    PTHR_ERR( pthread_cond_init( &(*buffer)->pthr.allow_remove, NULL ) );
-    PTHR_ERR( pthread_barrier_init( &(*buffer)->pthr.barrier, NULL, 2 ) );
+    PTHR_ERR( pthread_cond_init( &(*buffer)->pthr.buffer_not_empty, &attr ) );
+    PTHR_ERR( pthread_cond_init( &(*buffer)->pthr.buffer_not_full, NULL ) );
+    PTHR_ERR( pthread_barrier_init( &(*buffer)->pthr.barrier, NULL, STRMGR_WRITERS + 1 ) );
+    PTHR_ERR( pthread_condattr_destroy( &attr ) );
 
     return SBUFFER_SUCCESS;
 }
@@ -36,16 +51,10 @@ int sbuffer_free(sbuffer_t** buffer) {
     if ( buffer == NULL ||  *buffer == NULL )
         return SBUFFER_FAILURE;
 
-    while ( (*buffer)->head ) {
-        sbuffer_node_t* dummy = (*buffer)->head;
-        (*buffer)->head = (*buffer)->head->next;
-        free(dummy);
-    }
-
     PTHR_ERR( pthread_mutex_destroy( &(*buffer)->pthr.main_key ) );
     PTHR_ERR( pthread_mutex_destroy( &(*buffer)->pthr.write_key ) );
     PTHR_ERR( pthread_cond_destroy( &(*buffer)->pthr.buffer_not_empty ) );
-    PTHR_ERR( pthread_cond_destroy( &(*buffer)->pthr.allow_remove ) );
+    PTHR_ERR( pthread_cond_destroy( &(*buffer)->pthr.buffer_not_full ) );
     PTHR_ERR( pthread_barrier_destroy( &(*buffer)->pthr.barrier ) );
 
     free(*buffer);
@@ -54,96 +63,195 @@ int sbuffer_free(sbuffer_t** buffer) {
     return SBUFFER_SUCCESS;
 }
 
-int sbuffer_remove(sbuffer_t* buffer, sensor_data_t* data) {
+int sbuffer_remove(sbuffer_t* buffer, int writer, sensor_data_t* data) {
 
-    if (buffer == NULL)
-        return SBUFFER_FAILURE;
+    int count;
+    return sbuffer_remove_batch(buffer, writer, data, 1, &count);
+}
 
-    if (buffer->head == NULL)
-        return SBUFFER_NO_DATA;
+int sbuffer_read(sbuffer_t* buffer, int reader, sensor_data_t* data) {
 
-    PTHR_ERR( pthread_mutex_lock( &buffer->pthr.main_key ) );
-    while ( buffer->head->allow_remove == 0 )
-        PTHR_ERR( pthread_cond_wait( &buffer->pthr.allow_remove, &buffer->pthr.main_key ) );
+    int count;
+    return sbuffer_read_batch(buffer, reader, data, 1, &count);
+}
 
-    *data = buffer->head->element.data;
-    sbuffer_node_t* dummy = buffer->head;
+int sbuffer_insert(sbuffer_t* buffer, sensor_data_t* data) {
 
-    if (buffer->head == buffer->tail)
-        buffer->head = buffer->tail = NULL;
-    else
-        buffer->head = buffer->head->next;
+    return sbuffer_insert_batch(buffer, data, 1);
+}
 
-    free(dummy);
-    PTHR_ERR( pthread_mutex_unlock( &buffer->pthr.main_key ) );
+// readings inserted and not yet removed by every storagemgr writer
+size_t sbuffer_size(sbuffer_t* buffer) {
 
-    return SBUFFER_SUCCESS;
+    size_t head = sbuffer_min(buffer->head, STRMGR_WRITERS);
+    return atomic_load_explicit( &buffer->tail.pos, memory_order_relaxed ) - head;
 }
 
-int sbuffer_read(sbuffer_t* buffer, sensor_data_t* data) {
+// like sbuffer_read_batch(), a writer steps over every slot that all datamgr
+// shards are done with but only copies out its own partition
+int sbuffer_remove_batch(sbuffer_t* buffer, int writer, sensor_data_t* data, int max, int* count) {
 
-    if (buffer == NULL)
+    *count = 0;
+    if (buffer == NULL || writer < 0 || writer >= STRMGR_WRITERS)
         return SBUFFER_FAILURE;
 
-    if (buffer->mid == NULL)
+    size_t head = atomic_load_explicit( &buffer->head[writer].pos, memory_order_relaxed );
+    size_t mid = sbuffer_min(buffer->mid, DATAMGR_WORKERS);
+    if (head == mid)
         return SBUFFER_NO_DATA;
 
-    PTHR_ERR( pthread_mutex_lock( &buffer->pthr.main_key ) );
-    *data = buffer->mid->element.data;
-    buffer->mid->allow_remove = 1;
+    for (; head != mid && *count < max; head++) {
+        sensor_data_t* slot = &buffer->ring[head & SBUFFER_MASK].data;
+        if ( STRMGR_WRITERS == 1 || SBUFFER_PARTITION(slot->id) == writer )
+            data[(*count)++] = *slot;
+    }
+    atomic_store( &buffer->head[writer].pos, head );
 
-    if (buffer->mid == buffer->tail)
-        buffer->mid = NULL;
-    else
-        buffer->mid = buffer->mid->next;
+    sbuffer_wake(buffer, &buffer->blocked, &buffer->pthr.buffer_not_full);
 
-    PTHR_ERR( pthread_cond_broadcast( &buffer->pthr.allow_remove ) );
-    PTHR_ERR( pthread_mutex_unlock( &buffer->pthr.main_key ) );
+    return SBUFFER_SUCCESS;
+}
+
+// the reader steps over every slot but only copies out its own shard, so a
+// call can succeed with a count of 0 when nothing new belonged to it
+int sbuffer_read_batch(sbuffer_t* buffer, int reader, sensor_data_t* data, int max, int* count) {
+
+    *count = 0;
+    if (buffer == NULL || reader < 0 || reader >= DATAMGR_WORKERS)
+        return SBUFFER_FAILURE;
+
+    size_t mid = atomic_load_explicit( &buffer->mid[reader].pos, memory_order_relaxed );
+    size_t tail = atomic_load_explicit( &buffer->tail.pos, memory_order_acquire );
+    if (mid == tail)
+        return SBUFFER_NO_DATA;
+
+    for (; mid != tail && *count < max; mid++) {
+        sensor_data_t* slot = &buffer->ring[mid & SBUFFER_MASK].data;
+        if ( DATAMGR_WORKERS == 1 || SBUFFER_SHARD(slot->id) == reader )
+            data[(*count)++] = *slot;
+    }
+    atomic_store( &buffer->mid[reader].pos, mid );
+
+    sbuffer_wake(buffer, &buffer->sleepers, &buffer->pthr.buffer_not_empty);
 
     return SBUFFER_SUCCESS;
 }
 
-int sbuffer_insert(sbuffer_t* buffer, sensor_data_t* data) {
+int sbuffer_insert_batch(sbuffer_t* buffer, sensor_data_t* data, int count) {
 
     if (buffer == NULL)
         return SBUFFER_FAILURE;
 
-    sbuffer_node_t* dummy = malloc(sizeof(sbuffer_node_t));
+    PTHR_ERR( pthread_mutex_lock( &buffer->pthr.write_key ) );
+    size_t tail = atomic_load_explicit( &buffer->tail.pos, memory_order_relaxed );
 
-    if (dummy == NULL)
-        return SBUFFER_FAILURE;
+    while (count > 0) {
 
-    dummy->element.data = *data;
-    dummy->next = NULL;
-    dummy->allow_remove = 0;
+        size_t room = SBUFFER_CAPACITY - (tail - sbuffer_min(buffer->head, STRMGR_WRITERS));
+        if (room == 0) {
+            sbuffer_wait_not_full(buffer, tail);
+            continue;
+        }
 
-    PTHR_ERR( pthread_mutex_lock( &buffer->pthr.write_key ) );
-    if (buffer->tail == NULL) {
-        buffer->head = buffer->mid = buffer->tail = dummy;
-    } else {
-        buffer->tail->next = dummy;
-        buffer->tail = dummy;
-        if (buffer->mid == NULL)
-            buffer->mid = dummy;
-    }
+        int chunk = room < (size_t)count ? (int)room : count;
+        for (int i = 0; i < chunk; i++)
+            buffer->ring[(tail + i) & SBUFFER_MASK].data = data[i];
+
+        tail += chunk;
+        data += chunk;
+        count -= chunk;
+        atomic_store( &buffer->tail.pos, tail );
 
-    PTHR_ERR( pthread_cond_broadcast( &buffer->pthr.buffer_not_empty ) );
+        sbuffer_wake(buffer, &buffer->sleepers, &buffer->pthr.buffer_not_empty);
+    }
     PTHR_ERR( pthread_mutex_unlock( &buffer->pthr.write_key ) );
 
     return SBUFFER_SUCCESS;
 }
 
-int sbuffer_check_buffer(sbuffer_t* buffer, int check_head) {
+int sbuffer_check_buffer(sbuffer_t* buffer, int reader) {
+
+    return sbuffer_wait(buffer, reader, -1) == SBUFFER_SUCCESS;
+}
+
+// reader is a datamgr shard, or SBUFFER_HEAD(writer) for a storagemgr writer
+// waiting on readings that every shard is done with
+int sbuffer_wait(sbuffer_t* buffer, int reader, int timeout_ms) {
+
+    struct timespec deadline;
+    int rc = SBUFFER_SUCCESS;
+
+    if (timeout_ms >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
 
     PTHR_ERR( pthread_mutex_lock( &buffer->pthr.main_key ) );
-    while ( (buffer->head == NULL && check_head) || (buffer->mid == NULL && !check_head) ) {
-        if ( buffer->num.terminate == 1 ) {
-            PTHR_ERR( pthread_mutex_unlock( &buffer->pthr.main_key ) );
-            return 0;
+    atomic_fetch_add( &buffer->sleepers.pos, 1 );
+    while ( sbuffer_available(buffer, reader) == 0 ) {
+        if ( buffer->num.terminate == 1 && (reader >= 0 || sbuffer_min(buffer->mid, DATAMGR_WORKERS) == atomic_load( &buffer->tail.pos )) ) {
+            rc = SBUFFER_TERMINATED;
+            break;
         }
-        PTHR_ERR( pthread_cond_wait( &buffer->pthr.buffer_not_empty, &buffer->pthr.main_key ) );
+        if (timeout_ms < 0) {
+            PTHR_ERR( pthread_cond_wait( &buffer->pthr.buffer_not_empty, &buffer->pthr.main_key ) );
+        } else if ( pthread_cond_timedwait( &buffer->pthr.buffer_not_empty, &buffer->pthr.main_key, &deadline ) != 0 ) {
+            rc = SBUFFER_NO_DATA;
+            break;
+        }
+    }
+    atomic_fetch_sub( &buffer->sleepers.pos, 1 );
+    PTHR_ERR( pthread_mutex_unlock( &buffer->pthr.main_key ) );
+
+    return rc;
+}
+
+// readings the reader has yet to step over, a datamgr shard or SBUFFER_HEAD(writer)
+size_t sbuffer_available(sbuffer_t* buffer, int reader) {
+
+    // SBUFFER_HEAD() is its own inverse, so it maps the reader back to its writer
+    if (reader < 0)
+        return sbuffer_min(buffer->mid, DATAMGR_WORKERS) - atomic_load( &buffer->head[SBUFFER_HEAD(reader)].pos );
+    return atomic_load( &buffer->tail.pos ) - atomic_load( &buffer->mid[reader].pos );
+}
+
+// the slowest shard bounds how far the writers may remove, and the slowest
+// writer bounds how far the producers may fill
+size_t sbuffer_min(sbuffer_cursor_t* cursor, int count) {
+
+    size_t min = atomic_load( &cursor[0].pos );
+
+    for (int i = 1; i < count; i++) {
+        size_t pos = atomic_load( &cursor[i].pos );
+        if (pos < min)
+            min = pos;
     }
+    return min;
+}
+
+void sbuffer_wait_not_full(sbuffer_t* buffer, size_t tail) {
+
+    PTHR_ERR( pthread_mutex_lock( &buffer->pthr.main_key ) );
+    atomic_fetch_add( &buffer->blocked.pos, 1 );
+    while ( tail - sbuffer_min(buffer->head, STRMGR_WRITERS) == SBUFFER_CAPACITY )
+        PTHR_ERR( pthread_cond_wait( &buffer->pthr.buffer_not_full, &buffer->pthr.main_key ) );
+    atomic_fetch_sub( &buffer->blocked.pos, 1 );
     PTHR_ERR( pthread_mutex_unlock( &buffer->pthr.main_key ) );
+}
 
-    return 1;
+// the cursor was published with a sequentially consistent store, so a waiter
+// that registered itself before we looked has not missed the update
+void sbuffer_wake(sbuffer_t* buffer, sbuffer_cursor_t* waiters, pthread_cond_t* cond) {
+
+    if ( atomic_load( &waiters->pos ) == 0 )
+        return;
+
+    PTHR_ERR( pthread_mutex_lock( &buffer->pthr.main_key ) );
+    PTHR_ERR( pthread_cond_broadcast( cond ) );
+    PTHR_ERR( pthread_mutex_unlock( &buffer->pthr.main_key ) );
 }
@@ -2,15 +2,58 @@
 #define _SBUFFER_H_
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include "config.h"
 
 #define SBUFFER_FAILURE -1
 #define SBUFFER_SUCCESS 0
 #define SBUFFER_NO_DATA 1
+#define SBUFFER_TERMINATED 2
+
+#ifndef SBUFFER_CAPACITY
+  #define SBUFFER_CAPACITY 4096 // number of slots, must be a power of two
+#endif
+
+#ifndef SBUFFER_BATCH_SIZE
+  #define SBUFFER_BATCH_SIZE 64 // readings moved per call by the batch users
+#endif
+
+#ifndef SBUFFER_HIGH_WATERMARK
+  #define SBUFFER_HIGH_WATERMARK (SBUFFER_CAPACITY * 3 / 4) // connmgr stops reading sockets at this fill
+#endif
+
+#ifndef SBUFFER_LOW_WATERMARK
+  #define SBUFFER_LOW_WATERMARK (SBUFFER_CAPACITY / 4) // and reads them again once the fill drops to this
+#endif
+
+#ifndef DATAMGR_WORKERS
+  #define DATAMGR_WORKERS 1 // datamgr threads, each reading its own shard of sensor ids
+#endif
+
+#ifndef STRMGR_WRITERS
+  #define STRMGR_WRITERS 1 // storagemgr threads, each removing its own database partition
+#endif
+
+#define SBUFFER_CACHE_LINE 64
+#define SBUFFER_HEAD(writer) (-1 - (writer)) // reader passed by a storagemgr writer
+
+// sensor ids are spread over the datamgr shards and storage partitions by a
+// multiplicative hash, so every reading of one sensor goes to the same thread
+#define SBUFFER_HASH(id) ((uint32_t)(id) * 2654435769u >> 16)
+#define SBUFFER_SHARD(id) ((int)(SBUFFER_HASH(id) % DATAMGR_WORKERS))
+#define SBUFFER_PARTITION(id) ((int)(SBUFFER_HASH(id) % STRMGR_WRITERS))
+
+#if (SBUFFER_CAPACITY & (SBUFFER_CAPACITY - 1)) != 0
+    #error SBUFFER_CAPACITY must be a power of two
+#endif
+
+#if SBUFFER_LOW_WATERMARK >= SBUFFER_HIGH_WATERMARK || SBUFFER_HIGH_WATERMARK > SBUFFER_CAPACITY
+    #error SBUFFER_LOW_WATERMARK must be below SBUFFER_HIGH_WATERMARK, which must fit in SBUFFER_CAPACITY
+#endif
 
 typedef struct sbuffer sbuffer_t;
 typedef struct sbuffer_data sbuffer_data_t;
-typedef struct sbuffer_node sbuffer_node_t;
+typedef struct sbuffer_cursor sbuffer_cursor_t;
 typedef struct sbuffer_pthread sbuffer_pthread_t;
 typedef struct sbuffer_num sbuffer_num_t;
 
@@ -18,12 +61,12 @@ struct sbuffer_pthread {
     pthread_mutex_t main_key;
     pthread_mutex_t write_key;
     pthread_cond_t buffer_not_empty;
-    pthread_cond_t allow_remove;
+    pthread_cond_t buffer_not_full;
     pthread_barrier_t barrier;
 };
 
 struct sbuffer_num {
-    int initialize;
+    int initialize; // storagemgr writers that connected to their database
     int terminate;
 };
 
@@ -31,25 +74,36 @@ struct sbuffer_data {
     sensor_data_t data;
 };
 
-struct sbuffer_node {
-    struct sbuffer_node * next;
-    sbuffer_data_t element;
-    int allow_remove;
+// each cursor counts slots monotonically and sits on its own cache line
+struct sbuffer_cursor {
+    _Alignas(SBUFFER_CACHE_LINE) atomic_size_t pos;
 };
 
+// connmgr workers fill at tail (serialized on write_key), every datamgr worker
+// reads its shard at its own mid and every storagemgr writer removes its
+// partition at its own head, so that head[j] <= mid[i] <= tail at all times
 struct sbuffer {
-    sbuffer_node_t * head;
-    sbuffer_node_t * mid;
-    sbuffer_node_t * tail;
+    sbuffer_cursor_t head[STRMGR_WRITERS];
+    sbuffer_cursor_t mid[DATAMGR_WORKERS];
+    sbuffer_cursor_t tail;
+    sbuffer_cursor_t sleepers; // consumers waiting on buffer_not_empty
+    sbuffer_cursor_t blocked;  // producers waiting on buffer_not_full
     sbuffer_pthread_t pthr;
     sbuffer_num_t num;
+    _Alignas(SBUFFER_CACHE_LINE) sbuffer_data_t ring[SBUFFER_CAPACITY];
 };
 
 int sbuffer_init(sbuffer_t ** buffer);
 int sbuffer_free(sbuffer_t ** buffer);
-int sbuffer_remove(sbuffer_t * buffer, sensor_data_t * data);
+int sbuffer_remove(sbuffer_t * buffer, int writer, sensor_data_t * data);
 int sbuffer_insert(sbuffer_t * buffer, sensor_data_t * data);
-int sbuffer_check_buffer(sbuffer_t* buffer, int check_head);
-int sbuffer_read(sbuffer_t* buffer, sensor_data_t* data);
+int sbuffer_check_buffer(sbuffer_t* buffer, int reader);
+size_t sbuffer_size(sbuffer_t* buffer);
+size_t sbuffer_available(sbuffer_t* buffer, int reader);
+int sbuffer_wait(sbuffer_t* buffer, int reader, int timeout_ms);
+int sbuffer_read(sbuffer_t* buffer, int reader, sensor_data_t* data);
+int sbuffer_insert_batch(sbuffer_t* buffer, sensor_data_t* data, int count);
+int sbuffer_read_batch(sbuffer_t* buffer, int reader, sensor_data_t* data, int max, int* count);
+int sbuffer_remove_batch(sbuffer_t* buffer, int writer, sensor_data_t* data, int max, int* count);
 
 #endif  //_SBUFFER_H_
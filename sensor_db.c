@@ -4,47 +4,195 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sqlite3.h>
 
 #include "sensor_db.h"
+#include "metrics.h"
 #include "errmacros.h"
 
+typedef struct db_rollup {
+    sensor_id_t id;
+    sensor_ts_t minute;
+    int count;
+    sensor_value_t sum;
+    sensor_value_t min;
+    sensor_value_t max;
+} db_rollup_t;
+
+struct db_writer {
+    DBCONN* conn;
+    sqlite3_stmt* begin;
+    sqlite3_stmt* insert;
+    sqlite3_stmt* commit;
+    sqlite3_stmt* rollup[DB_ROLLUP_LEVELS];
+    db_rollup_t rollups[DB_ROLLUP_SLOTS];
+    int rollups_used;
+    sensor_data_t* rows; // of the open transaction, spilled if it is rolled back
+    int batch_size;
+    int flush_ms;
+    int pending;
+    long first_pending_ms;
+};
+
+#define DB_SPILL_MAGIC "GWSPIL2"
+#define DB_SPILL_MAGIC_V1 "GWSPILL"
+
+// a row of a GWSPILL journal, written before readings carried ingest_ns
+typedef struct db_spill_row_v1 {
+    sensor_id_t id;
+    sensor_value_t value;
+    sensor_ts_t ts;
+} db_spill_row_v1_t;
+
+typedef struct db_spill_header {
+    char magic[8];
+    uint64_t head; // rows replayed
+    uint64_t tail; // rows appended
+} db_spill_header_t;
+
+// the storage writer appends at tail and the replayer commits from head; the
+// mapping can move when the journal grows, so rows are only copied in and
+// out under key
+typedef struct db_spill {
+    DBCONN* conn;
+    int partition;
+    char* name;
+    int fd;
+    db_spill_header_t* map; // NULL until the first spill, unless a journal was left over
+    size_t size;
+    pthread_t replayer; // lives as long as the journal and sleeps between outages
+    int spilling; // rows go to the journal, set by the writer, cleared by the replayer
+    int stop;
+    pthread_mutex_t key;
+    pthread_cond_t wake;
+} db_spill_t;
+
+struct db_cursor {
+    sqlite3_stmt* stmt;
+    int done;
+};
+
+struct db_checkpointer {
+    DBCONN* conn;
+    pthread_t thread;
+    pthread_mutex_t key;
+    pthread_cond_t wake;
+    int stop;
+    atomic_int wrap;
+};
+
+static char* profile_names[] = { "journal", "wal", "fast" };
+static int rollup_seconds[DB_ROLLUP_LEVELS] = { DB_ROLLUP_MINUTE, DB_ROLLUP_HOUR, DB_ROLLUP_DAY };
+static char* rollup_tables[DB_ROLLUP_LEVELS] = { TO_STRING(TABLE_NAME) "_1m", TO_STRING(TABLE_NAME) "_1h", TO_STRING(TABLE_NAME) "_1d" };
+static int profile = DB_PROFILE_JOURNAL;
+
+static char* get_partition_name(int partition);
+static int apply_profile(DBCONN* conn);
+static int init_rollups(DBCONN* conn, char clear_up_flag);
+static int load_rooms(DBCONN* conn);
+static int create_view(DBCONN* conn, char* table);
+static void rollup_add(db_writer_t* writer, sensor_data_t* data);
+static int rollup_flush(db_writer_t* writer);
+static char* get_rollup_table(int resolution);
+static void* run_checkpointer(void* checkpointer);
+static int checkpointer_notify(void* checkpointer, DBCONN* conn, const char* db, int log_frames);
+static int checkpointer_busy(void* checkpointer, int count);
+static db_spill_t* spill_open(DBCONN* conn, int partition);
+static int spill_map(db_spill_t* spill, int create);
+static void spill_close(db_spill_t** spill);
+static int spill_append(db_spill_t* spill, sensor_data_t* data, int count, int force);
+static void spill_writer(db_spill_t* spill, db_writer_t* writer);
+static int spill_grow(db_spill_t* spill, uint64_t rows);
+static void spill_migrate(db_spill_t* spill);
+static void* run_replayer(void* spill);
+static void writer_rollback(db_writer_t* writer);
 static int execute_query(DBCONN* conn, char* sql, callback_t f, void* arg);
+static int execute_stmt(DBCONN* conn, sqlite3_stmt* stmt);
+static sqlite3_stmt* prepare_stmt(DBCONN* conn, char* sql);
+static int execute_select(DBCONN* conn, sqlite3_stmt* stmt, callback_t f);
+static db_cursor_t* cursor_init(sqlite3_stmt* stmt);
+static long get_time_ms();
 static int check_table(DBCONN* conn, callback_t f);
 static int get_table(void *arg, int count, char **value, char **name);
 
 
-void storagemgr_parse_sensor_data(DBCONN* conn, sbuffer_t** buffer) {
+void storagemgr_parse_sensor_data(DBCONN* conn, sbuffer_t** buffer, int partition) {
 
-    sensor_data_t data;
+    sensor_data_t data[SBUFFER_BATCH_SIZE];
+    int count;
 
-	while (*buffer != NULL) {
+    db_writer_t* writer = writer_init(conn, DB_BATCH_SIZE, DB_FLUSH_MS);
+    if (writer == NULL) {
+        LOG_PRINTF("Connection to SQL server lost\n");
+        return;
+    }
 
-        if ( sbuffer_check_buffer(*buffer, 1) == 0 )
+    db_checkpointer_t* checkpointer = NULL;
+    if (profile != DB_PROFILE_JOURNAL)
+        checkpointer = checkpointer_start(partition);
+    if (checkpointer != NULL)
+        sqlite3_wal_hook(conn, &checkpointer_notify, checkpointer);
+
+    db_spill_t* spill = spill_open(conn, partition);
+
+    while (*buffer != NULL) {
+
+        int rc = sbuffer_wait(*buffer, SBUFFER_HEAD(partition), writer_timeout(writer));
+
+        if (rc == SBUFFER_TERMINATED)
             break;
 
-        int rc = sbuffer_remove(*buffer, &data);
+        if (rc == SBUFFER_NO_DATA) {
+            if ( writer_flush(writer) != SQLITE_OK )
+                spill_writer(spill, writer);
+            continue;
+        }
+
+        rc = sbuffer_remove_batch(*buffer, partition, data, SBUFFER_BATCH_SIZE, &count);
         SBUFFER_ERR(rc);
 
-        if (rc == SBUFFER_NO_DATA)
+        // while the replayer catches up, new rows queue behind the journal
+        if ( spill_append(spill, data, count, 0) )
             continue;
 
-        if ( insert_sensor(conn, data.id, data.value, data.ts) != SQLITE_OK )
-            break;
+        int idx = 0;
+        rc = SQLITE_OK;
+        while (idx < count && rc == SQLITE_OK)
+            rc = writer_insert(writer, &data[idx++]);
+
+        if (rc != SQLITE_OK) {
+            spill_writer(spill, writer);
+            spill_append(spill, &data[idx], count - idx, 1);
+        }
     }
 
+    if ( writer_flush(writer) != SQLITE_OK )
+        spill_writer(spill, writer);
+    spill_close(&spill);
+    writer_free(&writer);
+    sqlite3_wal_hook(conn, NULL, NULL);
+    checkpointer_stop(&checkpointer);
     LOG_PRINTF("Connection to SQL server lost\n");
 }
 
-DBCONN* init_connection(char clear_up_flag) {
+DBCONN* init_connection(char clear_up_flag, int partition) {
 
     DBCONN* db;
     char* sql = "";
+    char* name = get_partition_name(partition);
 
-    int rc = sqlite3_open(TO_STRING(DB_NAME), &db);
+    int rc = sqlite3_open(name, &db);
+    free(name);
     if (rc != SQLITE_OK) {
         fprintf(stderr, "SQL error code %d: %s\n", rc, sqlite3_errmsg(db));
         sqlite3_close(db);
@@ -53,6 +201,11 @@ DBCONN* init_connection(char clear_up_flag) {
 
     LOG_PRINTF("Connection to SQL server established\n");
 
+    if ( apply_profile(db) != SQLITE_OK ) {
+        LOG_PRINTF("Connection to SQL server lost\n");
+        return NULL;
+    }
+
     if ( check_table(db, &get_table) == 0) {
 
         ASPRINTF_ERR( asprintf(&sql, "CREATE TABLE %s ("
@@ -72,6 +225,17 @@ DBCONN* init_connection(char clear_up_flag) {
         LOG_PRINTF("Table %s cleared\n", TO_STRING(TABLE_NAME));
     }
 
+    if (rc == SQLITE_OK)
+        rc = init_rollups(db, clear_up_flag);
+
+    // covering indexes for the per-sensor and the time range queries
+    if (rc == SQLITE_OK) {
+        ASPRINTF_ERR( asprintf(&sql,
+            "CREATE INDEX IF NOT EXISTS %1$s_sensor ON %1$s (sensor_id, timestamp, sensor_value); "
+            "CREATE INDEX IF NOT EXISTS %1$s_time ON %1$s (timestamp, sensor_id, sensor_value);", TO_STRING(TABLE_NAME)) );
+        rc = execute_query(db, sql, 0, NULL);
+    }
+
     if (rc != SQLITE_OK) {
         LOG_PRINTF("Connection to SQL server lost\n");
         return NULL;
@@ -80,6 +244,556 @@ DBCONN* init_connection(char clear_up_flag) {
     return db;
 }
 
+// read-only view over every partition: each database file is attached to an
+// in-memory connection and TABLE_NAME is shadowed by a temporary view that
+// unions them, so the find_sensor_* queries run unchanged across partitions
+DBCONN* connect_partitions() {
+
+    DBCONN* db;
+    char* sql;
+
+    int rc = sqlite3_open(":memory:", &db);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "SQL error code %d: %s\n", rc, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return NULL;
+    }
+
+    for (int partition = 0; partition < STRMGR_WRITERS && rc == SQLITE_OK; partition++) {
+
+        char* name = get_partition_name(partition);
+        ASPRINTF_ERR( asprintf(&sql, "ATTACH DATABASE '%s' AS p%d;", name, partition) );
+        free(name);
+        rc = execute_query(db, sql, 0, NULL);
+    }
+
+    if (rc == SQLITE_OK)
+        rc = create_view(db, TO_STRING(TABLE_NAME));
+    for (int level = 0; level < DB_ROLLUP_LEVELS && rc == SQLITE_OK; level++)
+        rc = create_view(db, rollup_tables[level]);
+
+    // every partition holds the whole room map
+    if (rc == SQLITE_OK) {
+        ASPRINTF_ERR( asprintf(&sql, "CREATE TEMP VIEW %1$s AS SELECT * FROM p0.%1$s;", TO_STRING(ROOM_TABLE_NAME)) );
+        rc = execute_query(db, sql, 0, NULL);
+    }
+
+    return rc == SQLITE_OK ? db : NULL;
+}
+
+int create_view(DBCONN* conn, char* table) {
+
+    char* sql;
+    char* view = NULL;
+
+    for (int partition = 0; partition < STRMGR_WRITERS; partition++) {
+        char* prev = view;
+        ASPRINTF_ERR( asprintf(&view, "%s%sSELECT * FROM p%d.%s", prev ? prev : "", prev ? " UNION ALL " : "", partition, table) );
+        free(prev);
+    }
+
+    ASPRINTF_ERR( asprintf(&sql, "CREATE TEMP VIEW %s AS %s;", table, view) );
+    free(view);
+    return execute_query(conn, sql, 0, NULL);
+}
+
+int init_rollups(DBCONN* conn, char clear_up_flag) {
+
+    char* sql;
+    int rc = SQLITE_OK;
+
+    for (int level = 0; level < DB_ROLLUP_LEVELS && rc == SQLITE_OK; level++) {
+        ASPRINTF_ERR( asprintf(&sql, "CREATE TABLE IF NOT EXISTS %s ("
+            "sensor_id      INT, "
+            "bucket         TIMESTAMP, "
+            "count          INT, "
+            "sum            REAL, "
+            "min            REAL, "
+            "max            REAL, "
+            "PRIMARY KEY (sensor_id, bucket) ) WITHOUT ROWID;", rollup_tables[level]) );
+        rc = execute_query(conn, sql, 0, NULL);
+
+        if (rc == SQLITE_OK && clear_up_flag) {
+            ASPRINTF_ERR( asprintf(&sql, "DELETE FROM %s;", rollup_tables[level]) );
+            rc = execute_query(conn, sql, 0, NULL);
+        }
+    }
+
+    if (rc == SQLITE_OK) {
+        ASPRINTF_ERR( asprintf(&sql, "CREATE TABLE IF NOT EXISTS %s ("
+            "sensor_id      INT PRIMARY KEY, "
+            "room_id        INT );", TO_STRING(ROOM_TABLE_NAME)) );
+        rc = execute_query(conn, sql, 0, NULL);
+    }
+
+    if (rc == SQLITE_OK)
+        rc = load_rooms(conn);
+
+    return rc;
+}
+
+// the room of every sensor, so that rollups can be aggregated per room
+int load_rooms(DBCONN* conn) {
+
+    int room_id, sensor_id;
+
+    FILE* fp_map = fopen(MAP_NAME, "r");
+    if (fp_map == NULL)
+        return SQLITE_OK;
+
+    sqlite3_stmt* stmt = prepare_stmt(conn, "INSERT OR REPLACE INTO " TO_STRING(ROOM_TABLE_NAME) " (sensor_id, room_id) VALUES (?, ?);");
+    int rc = stmt != NULL ? SQLITE_OK : SQLITE_ERROR;
+
+    while (rc == SQLITE_OK && fscanf(fp_map, "%d %d\n", &room_id, &sensor_id) == 2) {
+        sqlite3_bind_int(stmt, 1, sensor_id);
+        sqlite3_bind_int(stmt, 2, room_id);
+        rc = execute_stmt(conn, stmt);
+    }
+
+    sqlite3_finalize(stmt);
+    fclose(fp_map);
+    FILE_CLOSE_ERR(fp_map, MAP_NAME);
+
+    return rc;
+}
+
+int db_set_profile(char* name) {
+
+    for (int i = 0; i < sizeof(profile_names) / sizeof(profile_names[0]); i++) {
+        if (strcmp(name, profile_names[i]) == 0) {
+            profile = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// the page size has to be set before the journal mode, and the writer never
+// checkpoints itself so that a commit does not stall on copying the WAL back
+int apply_profile(DBCONN* conn) {
+
+    char* sql;
+
+    // WAL mode is stored in the file, so a journal profile has to undo it
+    if (profile == DB_PROFILE_JOURNAL) {
+        ASPRINTF_ERR( asprintf(&sql, "PRAGMA journal_mode = DELETE; PRAGMA busy_timeout = %d;", DB_BUSY_TIMEOUT_MS) );
+        return execute_query(conn, sql, 0, NULL);
+    }
+
+    ASPRINTF_ERR( asprintf(&sql,
+        "PRAGMA page_size = %d; "
+        "PRAGMA journal_mode = WAL; "
+        "PRAGMA synchronous = %s; "
+        "PRAGMA cache_size = -%d; "
+        "PRAGMA mmap_size = %lld; "
+        "PRAGMA wal_autocheckpoint = 0; "
+        "PRAGMA busy_timeout = %d;",
+        DB_PAGE_SIZE, profile == DB_PROFILE_FAST ? "OFF" : "NORMAL", DB_CACHE_KB, (long long)DB_MMAP_SIZE, DB_BUSY_TIMEOUT_MS) );
+
+    return execute_query(conn, sql, 0, NULL);
+}
+
+// checkpoints run on their own connection and thread; a passive checkpoint
+// never takes the write lock, so the writer keeps committing meanwhile
+db_checkpointer_t* checkpointer_start(int partition) {
+
+    db_checkpointer_t* checkpointer = calloc(1, sizeof(db_checkpointer_t));
+    ALLOC_ERR(checkpointer);
+    atomic_init( &checkpointer->wrap, 0 );
+
+    char* name = get_partition_name(partition);
+    int rc = sqlite3_open(name, &checkpointer->conn);
+    free(name);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "SQL error code %d: %s\n", rc, sqlite3_errmsg(checkpointer->conn));
+        sqlite3_close(checkpointer->conn);
+        free(checkpointer);
+        return NULL;
+    }
+
+    // a fresh connection only sees the WAL once it has read the journal mode
+    if ( apply_profile(checkpointer->conn) != SQLITE_OK ) {
+        free(checkpointer);
+        return NULL;
+    }
+
+    sqlite3_busy_handler(checkpointer->conn, &checkpointer_busy, checkpointer);
+
+    pthread_condattr_t attr;
+    PTHR_ERR( pthread_condattr_init( &attr ) );
+    PTHR_ERR( pthread_condattr_setclock( &attr, CLOCK_MONOTONIC ) );
+    PTHR_ERR( pthread_mutex_init( &checkpointer->key, NULL ) );
+    PTHR_ERR( pthread_cond_init( &checkpointer->wake, &attr ) );
+    PTHR_ERR( pthread_condattr_destroy( &attr ) );
+    PTHR_ERR( pthread_create( &checkpointer->thread, NULL, &run_checkpointer, checkpointer ) );
+
+    return checkpointer;
+}
+
+void checkpointer_stop(db_checkpointer_t** checkpointer) {
+
+    if (checkpointer == NULL || *checkpointer == NULL)
+        return;
+
+    PTHR_ERR( pthread_mutex_lock( &(*checkpointer)->key ) );
+    (*checkpointer)->stop = 1;
+    PTHR_ERR( pthread_cond_signal( &(*checkpointer)->wake ) );
+    PTHR_ERR( pthread_mutex_unlock( &(*checkpointer)->key ) );
+
+    PTHR_ERR( pthread_join( (*checkpointer)->thread, NULL ) );
+    PTHR_ERR( pthread_mutex_destroy( &(*checkpointer)->key ) );
+    PTHR_ERR( pthread_cond_destroy( &(*checkpointer)->wake ) );
+    disconnect((*checkpointer)->conn);
+
+    free(*checkpointer);
+    *checkpointer = NULL;
+}
+
+// runs on the writer after each commit, so it only wakes the checkpointer
+// once the log has grown past its limit and has to be started over
+int checkpointer_notify(void* ptr, DBCONN* conn, const char* db, int log_frames) {
+
+    db_checkpointer_t* checkpointer = (db_checkpointer_t*)ptr;
+
+    if (log_frames >= DB_WAL_LIMIT_FRAMES && atomic_exchange( &checkpointer->wrap, 1 ) == 0) {
+        PTHR_ERR( pthread_mutex_lock( &checkpointer->key ) );
+        PTHR_ERR( pthread_cond_signal( &checkpointer->wake ) );
+        PTHR_ERR( pthread_mutex_unlock( &checkpointer->key ) );
+    }
+    return SQLITE_OK;
+}
+
+// the writer only lets go of the write lock between two commits, so the
+// restart polls for that gap far more often than SQLite's busy timeout would
+int checkpointer_busy(void* ptr, int count) {
+
+    if (count >= DB_CHECKPOINT_MS * 1000 / DB_CHECKPOINT_POLL_US)
+        return 0;
+    usleep(DB_CHECKPOINT_POLL_US);
+    return 1;
+}
+
+void* run_checkpointer(void* ptr) {
+
+    db_checkpointer_t* checkpointer = (db_checkpointer_t*)ptr;
+    struct timespec deadline;
+    int log_frames, checkpointed;
+
+    PTHR_ERR( pthread_mutex_lock( &checkpointer->key ) );
+    while (checkpointer->stop == 0) {
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += DB_CHECKPOINT_MS / 1000;
+        deadline.tv_nsec += (DB_CHECKPOINT_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        if ( pthread_cond_timedwait( &checkpointer->wake, &checkpointer->key, &deadline ) == 0 && atomic_load( &checkpointer->wrap ) == 0 )
+            continue;
+        if (checkpointer->stop)
+            break;
+
+        PTHR_ERR( pthread_mutex_unlock( &checkpointer->key ) );
+        int rc = sqlite3_wal_checkpoint_v2(checkpointer->conn, NULL, SQLITE_CHECKPOINT_PASSIVE, &log_frames, &checkpointed);
+
+        // under sustained load the writer opens its next transaction right
+        // after each commit, so the log is never fully copied when it does
+        // and never wraps: only once it is past its limit, copy the few
+        // frames committed since the passive pass while holding writers off,
+        // so the next transaction starts the log over
+        if (rc == SQLITE_OK && log_frames >= DB_WAL_LIMIT_FRAMES)
+            rc = sqlite3_wal_checkpoint_v2(checkpointer->conn, NULL, SQLITE_CHECKPOINT_RESTART, &log_frames, &checkpointed);
+        atomic_store( &checkpointer->wrap, 0 );
+        if (rc != SQLITE_OK && rc != SQLITE_BUSY)
+            fprintf(stderr, "SQL error code %d: %s\n", rc, sqlite3_errmsg(checkpointer->conn));
+        DEBUG_PRINTF("Checkpointed %d of %d WAL frames...\n", checkpointed, log_frames);
+        PTHR_ERR( pthread_mutex_lock( &checkpointer->key ) );
+    }
+    PTHR_ERR( pthread_mutex_unlock( &checkpointer->key ) );
+
+    return NULL;
+}
+
+db_spill_t* spill_open(DBCONN* conn, int partition) {
+
+    db_spill_t* spill = calloc(1, sizeof(db_spill_t));
+    ALLOC_ERR(spill);
+
+    spill->conn = conn;
+    spill->partition = partition;
+    spill->fd = -1;
+
+    char* db_name = get_partition_name(partition);
+    ASPRINTF_ERR( asprintf(&spill->name, "%s-spill", db_name) );
+    free(db_name);
+
+    // the journal is only created once a commit fails, but one a previous
+    // run left behind is opened right away
+    if ( access(spill->name, F_OK) == 0 && spill_map(spill, 0) != 0 )
+        ERROR_PRINTF("Unable to open the spill journal of partition %d\n", partition);
+
+    // the stamps of a previous run are on another monotonic clock, and
+    // would only distort this run's commit latencies
+    if (spill->map != NULL) {
+        sensor_data_t* rows = (sensor_data_t*)(spill->map + 1);
+        for (uint64_t row = spill->map->head; row < spill->map->tail; row++)
+            rows[row].ingest_ns = 0;
+    }
+
+    pthread_condattr_t attr;
+    PTHR_ERR( pthread_condattr_init( &attr ) );
+    PTHR_ERR( pthread_condattr_setclock( &attr, CLOCK_MONOTONIC ) );
+    PTHR_ERR( pthread_mutex_init( &spill->key, NULL ) );
+    PTHR_ERR( pthread_cond_init( &spill->wake, &attr ) );
+    PTHR_ERR( pthread_condattr_destroy( &attr ) );
+    PTHR_ERR( pthread_create( &spill->replayer, NULL, &run_replayer, spill ) );
+
+    // rows a previous run could not store go in before any new one
+    if (spill->map != NULL && spill->map->head < spill->map->tail) {
+        LOG_PRINTF("Replaying %ld readings left in the spill journal of partition %d\n", (long)(spill->map->tail - spill->map->head), partition);
+        spill_append(spill, NULL, 0, 1);
+    }
+
+    return spill;
+}
+
+// blocks are allocated up front, as in spill_grow(), so a full disk fails
+// here rather than raising SIGBUS on the first append
+int spill_map(db_spill_t* spill, int create) {
+
+    spill->fd = open(spill->name, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+    if (spill->fd == -1)
+        return -1;
+
+    struct stat st;
+    SYS_ERR( fstat(spill->fd, &st) );
+    spill->size = st.st_size > DB_SPILL_SIZE ? st.st_size : DB_SPILL_SIZE;
+
+    if ( posix_fallocate(spill->fd, 0, spill->size) != 0 ) {
+        fprintf(stderr, "Unable to create the spill journal of partition %d\n", spill->partition);
+        SYS_ERR( close(spill->fd) );
+        spill->fd = -1;
+        return -1;
+    }
+
+    spill->map = mmap(NULL, spill->size, PROT_READ | PROT_WRITE, MAP_SHARED, spill->fd, 0);
+    if (spill->map == MAP_FAILED)
+        ERROR_PRINTF("Unable to map the spill journal of partition %d\n", spill->partition);
+
+    if ( memcmp(spill->map->magic, DB_SPILL_MAGIC_V1, sizeof(spill->map->magic)) == 0 ) {
+        spill_migrate(spill);
+    } else if ( memcmp(spill->map->magic, DB_SPILL_MAGIC, sizeof(spill->map->magic)) != 0 ) {
+        memcpy(spill->map->magic, DB_SPILL_MAGIC, sizeof(spill->map->magic));
+        spill->map->head = spill->map->tail = 0;
+    }
+    return 0;
+}
+
+// waits for the replayer, which stops early only if the database still
+// fails, and rows not replayed by then stay in the journal for the next run;
+// an empty journal is removed
+void spill_close(db_spill_t** spill) {
+
+    PTHR_ERR( pthread_mutex_lock( &(*spill)->key ) );
+    (*spill)->stop = 1;
+    PTHR_ERR( pthread_cond_signal( &(*spill)->wake ) );
+    PTHR_ERR( pthread_mutex_unlock( &(*spill)->key ) );
+
+    PTHR_ERR( pthread_join( (*spill)->replayer, NULL ) );
+
+    if ((*spill)->map != NULL) {
+        uint64_t left = (*spill)->map->tail - (*spill)->map->head;
+        if (left > 0) {
+            LOG_PRINTF("%ld readings of partition %d are kept in the spill journal\n", (long)left, (*spill)->partition);
+            SYS_ERR( msync((*spill)->map, (*spill)->size, MS_SYNC) );
+        } else {
+            SYS_ERR( unlink((*spill)->name) );
+        }
+        SYS_ERR( munmap((*spill)->map, (*spill)->size) );
+        SYS_ERR( close((*spill)->fd) );
+    }
+    PTHR_ERR( pthread_mutex_destroy( &(*spill)->key ) );
+    PTHR_ERR( pthread_cond_destroy( &(*spill)->wake ) );
+
+    free((*spill)->name);
+    free(*spill);
+    *spill = NULL;
+}
+
+// appends the rows if the journal is in use, or with force puts it in use
+// and wakes the replayer; returns whether the rows were taken
+int spill_append(db_spill_t* spill, sensor_data_t* data, int count, int force) {
+
+    PTHR_ERR( pthread_mutex_lock( &spill->key ) );
+
+    if (!spill->spilling && !force) {
+        PTHR_ERR( pthread_mutex_unlock( &spill->key ) );
+        return 0;
+    }
+
+    // a full disk holds the writer here, and the buffer's backpressure the
+    // sensors, rather than dropping rows; the replayer is only woken
+    // once the journal exists
+    while ( (spill->map == NULL && spill_map(spill, 1) != 0) || spill_grow(spill, spill->map->tail + count) != 0 ) {
+        PTHR_ERR( pthread_mutex_unlock( &spill->key ) );
+        usleep(DB_RETRY_MS * 1000);
+        PTHR_ERR( pthread_mutex_lock( &spill->key ) );
+    }
+
+    if (!spill->spilling) {
+        spill->spilling = 1;
+        PTHR_ERR( pthread_cond_signal( &spill->wake ) );
+        LOG_PRINTF("Readings of partition %d are spilled to disk until the SQL server takes them again\n", spill->partition);
+    }
+
+    sensor_data_t* rows = (sensor_data_t*)(spill->map + 1);
+    memcpy(&rows[spill->map->tail], data, count * sizeof(sensor_data_t));
+    spill->map->tail += count;
+    metrics_add(METRIC_DB_SPILLED, count);
+
+    PTHR_ERR( pthread_mutex_unlock( &spill->key ) );
+    return 1;
+}
+
+void spill_writer(db_spill_t* spill, db_writer_t* writer) {
+
+    spill_append(spill, writer->rows, writer->pending, 1);
+    writer->pending = 0;
+}
+
+// rewrites the rows a GWSPILL journal has left into the current layout,
+// from the start of the file, so none of them is lost to the new format
+void spill_migrate(db_spill_t* spill) {
+
+    if (spill->map->head > spill->map->tail || sizeof(db_spill_header_t) + spill->map->tail * sizeof(db_spill_row_v1_t) > spill->size) {
+        LOG_PRINTF("The older spill journal of partition %d is damaged and was dropped\n", spill->partition);
+        spill->map->head = spill->map->tail = 0;
+    }
+
+    uint64_t count = spill->map->tail - spill->map->head;
+    db_spill_row_v1_t* old = malloc(count * sizeof(db_spill_row_v1_t) + 1);
+    ALLOC_ERR(old);
+    memcpy(old, (db_spill_row_v1_t*)(spill->map + 1) + spill->map->head, count * sizeof(db_spill_row_v1_t));
+
+    if ( spill_grow(spill, count) != 0 )
+        ERROR_PRINTF("Unable to migrate the spill journal of partition %d\n", spill->partition);
+
+    sensor_data_t* rows = (sensor_data_t*)(spill->map + 1);
+    for (uint64_t row = 0; row < count; row++)
+        rows[row] = (sensor_data_t){ .id = old[row].id, .value = old[row].value, .ts = old[row].ts, .ingest_ns = 0 };
+    free(old);
+
+    spill->map->head = 0;
+    spill->map->tail = count;
+    memcpy(spill->map->magic, DB_SPILL_MAGIC, sizeof(spill->map->magic));
+    LOG_PRINTF("Migrated %ld readings of partition %d from an older spill journal\n", (long)count, spill->partition);
+}
+
+// blocks are allocated up front, since a write to a hole in a full file
+// system would raise SIGBUS instead of failing
+int spill_grow(db_spill_t* spill, uint64_t rows) {
+
+    size_t needed = sizeof(db_spill_header_t) + rows * sizeof(sensor_data_t);
+    size_t size = spill->size;
+
+    if (needed <= size)
+        return 0;
+
+    while (size < needed)
+        size *= 2;
+
+    if ( posix_fallocate(spill->fd, 0, size) != 0 ) {
+        fprintf(stderr, "Unable to grow the spill journal of partition %d\n", spill->partition);
+        return -1;
+    }
+
+    void* map = mremap(spill->map, spill->size, size, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED)
+        return -1;
+
+    spill->map = map;
+    spill->size = size;
+    return 0;
+}
+
+// commits the journal in batches through a writer of its own on the same
+// connection, which the storage writer leaves alone while it spills; once
+// the journal is empty it is reset and spilling is cleared under the same
+// lock that appends take, so no row can slip in behind the hand-over, and
+// the thread sleeps until the next outage
+void* run_replayer(void* ptr) {
+
+    db_spill_t* spill = (db_spill_t*)ptr;
+    db_writer_t* writer = NULL;
+    sensor_data_t rows[DB_BATCH_SIZE];
+    long replayed = 0;
+    struct timespec deadline;
+
+    metrics_register("replayer", spill->partition);
+
+    PTHR_ERR( pthread_mutex_lock( &spill->key ) );
+    while (1) {
+
+        if (spill->map == NULL || spill->map->head == spill->map->tail) {
+            if (spill->spilling) {
+                writer_free(&writer);
+                spill->map->head = spill->map->tail = 0;
+                spill->spilling = 0;
+                LOG_PRINTF("Replayed %ld spilled readings of partition %d into the SQL server\n", replayed, spill->partition);
+                replayed = 0;
+            }
+            if (spill->stop)
+                break;
+            PTHR_ERR( pthread_cond_wait( &spill->wake, &spill->key ) );
+            continue;
+        }
+
+        if (writer == NULL)
+            writer = writer_init(spill->conn, DB_BATCH_SIZE, INT32_MAX);
+
+        uint64_t left = spill->map->tail - spill->map->head;
+        int count = left < DB_BATCH_SIZE ? (int)left : DB_BATCH_SIZE;
+        memcpy(rows, (sensor_data_t*)(spill->map + 1) + spill->map->head, count * sizeof(sensor_data_t));
+        PTHR_ERR( pthread_mutex_unlock( &spill->key ) );
+
+        // a batch is committed whole or not at all, so head only ever
+        // moves past rows that are in the database
+        int rc = writer == NULL ? SQLITE_ERROR : SQLITE_OK;
+        for (int idx = 0; idx < count && rc == SQLITE_OK; idx++)
+            rc = writer_insert(writer, &rows[idx]);
+        if (rc == SQLITE_OK)
+            rc = writer_flush(writer);
+        if (rc != SQLITE_OK && writer != NULL)
+            writer->pending = 0;
+
+        PTHR_ERR( pthread_mutex_lock( &spill->key ) );
+        if (rc == SQLITE_OK) {
+            spill->map->head += count;
+            replayed += count;
+            continue;
+        }
+
+        // on shutdown a database that still fails leaves the rest for the next run
+        if (spill->stop)
+            break;
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += DB_RETRY_MS / 1000;
+        deadline.tv_nsec += (DB_RETRY_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait( &spill->wake, &spill->key, &deadline );
+    }
+    PTHR_ERR( pthread_mutex_unlock( &spill->key ) );
+
+    writer_free(&writer);
+    return NULL;
+}
+
 void disconnect(DBCONN* conn) {
 
     if (conn == NULL)
@@ -99,39 +813,341 @@ int insert_sensor(DBCONN* conn, sensor_id_t id, sensor_value_t value, sensor_ts_
     return execute_query(conn, sql, 0, NULL);
 }
 
-int find_sensor_all(DBCONN* conn, callback_t f) {
+db_writer_t* writer_init(DBCONN* conn, int batch_size, int flush_ms) {
 
     char* sql;
-    ASPRINTF_ERR( asprintf(&sql, "SELECT * FROM %s;", TO_STRING(TABLE_NAME)) );
-    return execute_query(conn, sql, f, NULL);
+    db_writer_t* writer = calloc(1, sizeof(db_writer_t));
+    ALLOC_ERR(writer);
+
+    writer->conn = conn;
+    writer->batch_size = batch_size > 0 ? batch_size : 1;
+    writer->flush_ms = flush_ms;
+    writer->rows = calloc(writer->batch_size, sizeof(sensor_data_t));
+    ALLOC_ERR(writer->rows);
+
+    ASPRINTF_ERR( asprintf(&sql, "INSERT INTO %s (sensor_id, sensor_value, timestamp) VALUES (?, ?, ?);", TO_STRING(TABLE_NAME)) );
+
+    int rc = sqlite3_prepare_v2(conn, "BEGIN;", -1, &writer->begin, NULL);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_prepare_v2(conn, "COMMIT;", -1, &writer->commit, NULL);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_prepare_v2(conn, sql, -1, &writer->insert, NULL);
+    free(sql);
+
+    for (int level = 0; level < DB_ROLLUP_LEVELS && rc == SQLITE_OK; level++) {
+        ASPRINTF_ERR( asprintf(&sql, "INSERT INTO %s (sensor_id, bucket, count, sum, min, max) VALUES (?, ?, ?, ?, ?, ?) "
+            "ON CONFLICT (sensor_id, bucket) DO UPDATE SET count = count + excluded.count, sum = sum + excluded.sum, "
+            "min = MIN(min, excluded.min), max = MAX(max, excluded.max);", rollup_tables[level]) );
+        rc = sqlite3_prepare_v2(conn, sql, -1, &writer->rollup[level], NULL);
+        free(sql);
+    }
+
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "SQL error code %d: %s\n", rc, sqlite3_errmsg(conn));
+        writer_free(&writer);
+        return NULL;
+    }
+
+    return writer;
+}
+
+int writer_insert(db_writer_t* writer, sensor_data_t* data) {
+
+    DEBUG_PRINTF("Inserting data from sensor %d at %ld into the SQL database...\n", data->id, data->ts);
+
+    int rc = SQLITE_OK;
+    if (writer->pending == 0) {
+        rc = execute_stmt(writer->conn, writer->begin);
+        writer->first_pending_ms = get_time_ms();
+    }
+
+    // whatever fails below, the row is kept with the rolled back ones
+    writer->rows[writer->pending++] = *data;
+    if (rc != SQLITE_OK)
+        return rc;
+
+    sqlite3_bind_int(writer->insert, 1, data->id);
+    sqlite3_bind_double(writer->insert, 2, data->value);
+    sqlite3_bind_int64(writer->insert, 3, data->ts);
+
+    rc = execute_stmt(writer->conn, writer->insert);
+    if (rc != SQLITE_OK) {
+        writer_rollback(writer);
+        return rc;
+    }
+
+    rollup_add(writer, data);
+
+    if (writer->rollups_used * 2 >= DB_ROLLUP_SLOTS) {
+        rc = rollup_flush(writer);
+        if (rc != SQLITE_OK) {
+            writer_rollback(writer);
+            return rc;
+        }
+    }
+
+    if (writer->pending >= writer->batch_size || writer_timeout(writer) == 0)
+        return writer_flush(writer);
+
+    return SQLITE_OK;
+}
+
+int writer_flush(db_writer_t* writer) {
+
+    if (writer->pending == 0)
+        return SQLITE_OK;
+
+    DEBUG_PRINTF("Committing %d rows into the SQL database...\n", writer->pending);
+
+    int rc = rollup_flush(writer);
+    if (rc == SQLITE_OK)
+        rc = execute_stmt(writer->conn, writer->commit);
+    if (rc != SQLITE_OK) {
+        writer_rollback(writer);
+        return rc;
+    }
+
+    metrics_add(METRIC_DB_COMMITS, 1);
+    metrics_add(METRIC_DB_ROWS, writer->pending);
+    metrics_latency(LATENCY_COMMIT, writer->rows, writer->pending);
+    writer->pending = 0;
+    return rc;
+}
+
+// the rolled back rows, including the one a failed writer_insert() was
+// given, stay in writer->rows with writer->pending counting them until the
+// caller takes them; the minute table is dropped with them
+void writer_rollback(db_writer_t* writer) {
+
+    sqlite3_exec(writer->conn, "ROLLBACK;", NULL, NULL, NULL);
+
+    memset(writer->rollups, 0, sizeof(writer->rollups));
+    writer->rollups_used = 0;
+}
+
+// readings are first folded per sensor and minute in an open addressed
+// table, so a transaction writes each touched bucket once per level
+void rollup_add(db_writer_t* writer, sensor_data_t* data) {
+
+    sensor_ts_t minute = data->ts - data->ts % DB_ROLLUP_MINUTE;
+    uint32_t slot = SBUFFER_HASH(data->id) ^ (uint32_t)(minute / DB_ROLLUP_MINUTE) * 2654435769u;
+    db_rollup_t* rollup;
+
+    for (;; slot++) {
+        rollup = &writer->rollups[slot & (DB_ROLLUP_SLOTS - 1)];
+        if (rollup->count == 0 || (rollup->id == data->id && rollup->minute == minute))
+            break;
+    }
+
+    if (rollup->count == 0) {
+        rollup->id = data->id;
+        rollup->minute = minute;
+        rollup->min = rollup->max = data->value;
+        writer->rollups_used++;
+    }
+
+    rollup->count++;
+    rollup->sum += data->value;
+    if (data->value < rollup->min)
+        rollup->min = data->value;
+    if (data->value > rollup->max)
+        rollup->max = data->value;
+}
+
+int rollup_flush(db_writer_t* writer) {
+
+    int rc = SQLITE_OK;
+
+    for (int i = 0; i < DB_ROLLUP_SLOTS && writer->rollups_used > 0; i++) {
+
+        db_rollup_t* rollup = &writer->rollups[i];
+        if (rollup->count == 0)
+            continue;
+
+        for (int level = 0; level < DB_ROLLUP_LEVELS && rc == SQLITE_OK; level++) {
+            sqlite3_stmt* stmt = writer->rollup[level];
+            sqlite3_bind_int(stmt, 1, rollup->id);
+            sqlite3_bind_int64(stmt, 2, rollup->minute - rollup->minute % rollup_seconds[level]);
+            sqlite3_bind_int(stmt, 3, rollup->count);
+            sqlite3_bind_double(stmt, 4, rollup->sum);
+            sqlite3_bind_double(stmt, 5, rollup->min);
+            sqlite3_bind_double(stmt, 6, rollup->max);
+            rc = execute_stmt(writer->conn, stmt);
+        }
+
+        rollup->count = 0;
+        rollup->sum = 0;
+        writer->rollups_used--;
+    }
+
+    return rc;
+}
+
+int writer_timeout(db_writer_t* writer) {
+
+    if (writer->pending == 0)
+        return -1;
+
+    long remaining = writer->first_pending_ms + writer->flush_ms - get_time_ms();
+    return remaining > 0 ? (int)remaining : 0;
+}
+
+int writer_free(db_writer_t** writer) {
+
+    if (writer == NULL || *writer == NULL)
+        return SQLITE_OK;
+
+    int rc = SQLITE_OK;
+    if ((*writer)->commit != NULL)
+        rc = writer_flush(*writer);
+    free((*writer)->rows);
+
+    sqlite3_finalize((*writer)->begin);
+    sqlite3_finalize((*writer)->insert);
+    sqlite3_finalize((*writer)->commit);
+    for (int level = 0; level < DB_ROLLUP_LEVELS; level++)
+        sqlite3_finalize((*writer)->rollup[level]);
+
+    free(*writer);
+    *writer = NULL;
+
+    return rc;
+}
+
+int find_sensor_all(DBCONN* conn, callback_t f) {
+
+    sqlite3_stmt* stmt = prepare_stmt(conn, "SELECT * FROM " TO_STRING(TABLE_NAME) ";");
+    return execute_select(conn, stmt, f);
 }
 
 int find_sensor_by_value(DBCONN* conn, sensor_value_t value, callback_t f) {
 
-    char* sql;
-    ASPRINTF_ERR( asprintf(&sql, "SELECT * FROM %s WHERE sensor_value = %f;", TO_STRING(TABLE_NAME), value) );
-    return execute_query(conn, sql, f, NULL);
+    sqlite3_stmt* stmt = prepare_stmt(conn, "SELECT * FROM " TO_STRING(TABLE_NAME) " WHERE sensor_value = ?;");
+    sqlite3_bind_double(stmt, 1, value);
+    return execute_select(conn, stmt, f);
 }
 
 int find_sensor_exceed_value(DBCONN* conn, sensor_value_t value, callback_t f) {
 
-    char* sql;
-    ASPRINTF_ERR( asprintf(&sql, "SELECT * FROM %s WHERE sensor_value > %f;", TO_STRING(TABLE_NAME), value) );
-    return execute_query(conn, sql, f, NULL);
+    sqlite3_stmt* stmt = prepare_stmt(conn, "SELECT * FROM " TO_STRING(TABLE_NAME) " WHERE sensor_value > ?;");
+    sqlite3_bind_double(stmt, 1, value);
+    return execute_select(conn, stmt, f);
 }
 
 int find_sensor_by_timestamp(DBCONN* conn, sensor_ts_t ts, callback_t f) {
 
-    char* sql;
-    ASPRINTF_ERR( asprintf(&sql, "SELECT * FROM %s WHERE timestamp = %ld;", TO_STRING(TABLE_NAME), ts) );
-    return execute_query(conn, sql, f, NULL);
+    sqlite3_stmt* stmt = prepare_stmt(conn, "SELECT * FROM " TO_STRING(TABLE_NAME) " WHERE timestamp = ?;");
+    sqlite3_bind_int64(stmt, 1, ts);
+    return execute_select(conn, stmt, f);
 }
 
 int find_sensor_after_timestamp(DBCONN* conn, sensor_ts_t ts, callback_t f) {
 
+    sqlite3_stmt* stmt = prepare_stmt(conn, "SELECT * FROM " TO_STRING(TABLE_NAME) " WHERE timestamp > ?;");
+    sqlite3_bind_int64(stmt, 1, ts);
+    return execute_select(conn, stmt, f);
+}
+
+// the cursors only select indexed columns, so a range is answered from the
+// covering index alone and handed out a batch at a time
+db_cursor_t* cursor_by_sensor(DBCONN* conn, sensor_id_t id, sensor_ts_t from, sensor_ts_t to) {
+
+    sqlite3_stmt* stmt = prepare_stmt(conn, "SELECT sensor_id, sensor_value, timestamp FROM " TO_STRING(TABLE_NAME)
+        " WHERE sensor_id = ? AND timestamp >= ? AND timestamp < ? ORDER BY timestamp;");
+    if (stmt == NULL)
+        return NULL;
+
+    sqlite3_bind_int(stmt, 1, id);
+    sqlite3_bind_int64(stmt, 2, from);
+    sqlite3_bind_int64(stmt, 3, to);
+    return cursor_init(stmt);
+}
+
+db_cursor_t* cursor_by_time(DBCONN* conn, sensor_ts_t from, sensor_ts_t to) {
+
+    sqlite3_stmt* stmt = prepare_stmt(conn, "SELECT sensor_id, sensor_value, timestamp FROM " TO_STRING(TABLE_NAME)
+        " WHERE timestamp >= ? AND timestamp < ? ORDER BY timestamp;");
+    if (stmt == NULL)
+        return NULL;
+
+    sqlite3_bind_int64(stmt, 1, from);
+    sqlite3_bind_int64(stmt, 2, to);
+    return cursor_init(stmt);
+}
+
+int cursor_next(db_cursor_t* cursor, sensor_data_t* data, int max, int* count) {
+
+    *count = 0;
+    if (cursor->done)
+        return SQLITE_DONE;
+
+    while (*count < max) {
+        int rc = sqlite3_step(cursor->stmt);
+        if (rc == SQLITE_DONE) {
+            cursor->done = 1;
+            return *count > 0 ? SQLITE_ROW : SQLITE_DONE;
+        }
+        if (rc != SQLITE_ROW) {
+            fprintf(stderr, "SQL error code %d: %s\n", rc, sqlite3_errmsg(sqlite3_db_handle(cursor->stmt)));
+            return rc;
+        }
+
+        data[*count].id = sqlite3_column_int(cursor->stmt, 0);
+        data[*count].value = sqlite3_column_double(cursor->stmt, 1);
+        data[*count].ts = sqlite3_column_int64(cursor->stmt, 2);
+        data[*count].ingest_ns = 0;
+        (*count)++;
+    }
+
+    return SQLITE_ROW;
+}
+
+// one row per bucket: bucket, count, min, max, avg
+int find_rollup_by_sensor(DBCONN* conn, int resolution, sensor_id_t id, sensor_ts_t from, sensor_ts_t to, callback_t f) {
+
     char* sql;
-    ASPRINTF_ERR( asprintf(&sql, "SELECT * FROM %s WHERE timestamp > %ld;", TO_STRING(TABLE_NAME), ts) );
-    return execute_query(conn, sql, f, NULL);
+    char* table = get_rollup_table(resolution);
+    if (table == NULL)
+        return SQLITE_MISUSE;
+
+    ASPRINTF_ERR( asprintf(&sql, "SELECT bucket, count, min, max, sum / count AS avg FROM %s "
+        "WHERE sensor_id = ? AND bucket >= ? AND bucket < ? ORDER BY bucket;", table) );
+    sqlite3_stmt* stmt = prepare_stmt(conn, sql);
+    free(sql);
+
+    sqlite3_bind_int(stmt, 1, id);
+    sqlite3_bind_int64(stmt, 2, from);
+    sqlite3_bind_int64(stmt, 3, to);
+    return execute_select(conn, stmt, f);
+}
+
+int find_rollup_by_room(DBCONN* conn, int resolution, uint16_t room_id, sensor_ts_t from, sensor_ts_t to, callback_t f) {
+
+    char* sql;
+    char* table = get_rollup_table(resolution);
+    if (table == NULL)
+        return SQLITE_MISUSE;
+
+    ASPRINTF_ERR( asprintf(&sql, "SELECT r.bucket AS bucket, SUM(r.count) AS count, MIN(r.min) AS min, MAX(r.max) AS max, "
+        "SUM(r.sum) / SUM(r.count) AS avg FROM %s r JOIN %s s ON s.sensor_id = r.sensor_id "
+        "WHERE s.room_id = ? AND r.bucket >= ? AND r.bucket < ? GROUP BY r.bucket ORDER BY r.bucket;", table, TO_STRING(ROOM_TABLE_NAME)) );
+    sqlite3_stmt* stmt = prepare_stmt(conn, sql);
+    free(sql);
+
+    sqlite3_bind_int(stmt, 1, room_id);
+    sqlite3_bind_int64(stmt, 2, from);
+    sqlite3_bind_int64(stmt, 3, to);
+    return execute_select(conn, stmt, f);
+}
+
+void cursor_close(db_cursor_t** cursor) {
+
+    if (cursor == NULL || *cursor == NULL)
+        return;
+
+    sqlite3_finalize((*cursor)->stmt);
+    free(*cursor);
+    *cursor = NULL;
 }
 
 int execute_query(DBCONN* conn, char* sql, callback_t f, void* arg) {
@@ -150,6 +1166,95 @@ int execute_query(DBCONN* conn, char* sql, callback_t f, void* arg) {
     return SQLITE_OK;
 }
 
+int execute_stmt(DBCONN* conn, sqlite3_stmt* stmt) {
+
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+
+    if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
+        fprintf(stderr, "SQL error code %d: %s\n", rc, sqlite3_errmsg(conn));
+        return rc;
+    }
+
+    return SQLITE_OK;
+}
+
+char* get_partition_name(int partition) {
+
+    char* name;
+    if (STRMGR_WRITERS == 1)
+        ASPRINTF_ERR( asprintf(&name, "%s", TO_STRING(DB_NAME)) );
+    else
+        ASPRINTF_ERR( asprintf(&name, DB_PARTITION_NAME, partition) );
+    return name;
+}
+
+sqlite3_stmt* prepare_stmt(DBCONN* conn, char* sql) {
+
+    sqlite3_stmt* stmt;
+
+    int rc = sqlite3_prepare_v2(conn, sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "SQL error code %d: %s\n", rc, sqlite3_errmsg(conn));
+        return NULL;
+    }
+    return stmt;
+}
+
+// hands every row to f like sqlite3_exec() would, without building the SQL
+int execute_select(DBCONN* conn, sqlite3_stmt* stmt, callback_t f) {
+
+    if (stmt == NULL)
+        return SQLITE_ERROR;
+
+    int rc, columns = sqlite3_column_count(stmt);
+    char* value[columns];
+    char* name[columns];
+
+    for (int i = 0; i < columns; i++)
+        name[i] = (char*)sqlite3_column_name(stmt, i);
+
+    while ( (rc = sqlite3_step(stmt)) == SQLITE_ROW ) {
+        for (int i = 0; i < columns; i++)
+            value[i] = (char*)sqlite3_column_text(stmt, i);
+        if ( f != NULL && f(NULL, columns, value, name) != 0 ) {
+            rc = SQLITE_ABORT;
+            break;
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL error code %d: %s\n", rc, sqlite3_errmsg(conn));
+        return rc;
+    }
+    return SQLITE_OK;
+}
+
+db_cursor_t* cursor_init(sqlite3_stmt* stmt) {
+
+    db_cursor_t* cursor = calloc(1, sizeof(db_cursor_t));
+    ALLOC_ERR(cursor);
+
+    cursor->stmt = stmt;
+    return cursor;
+}
+
+char* get_rollup_table(int resolution) {
+
+    for (int level = 0; level < DB_ROLLUP_LEVELS; level++)
+        if (rollup_seconds[level] == resolution)
+            return rollup_tables[level];
+    return NULL;
+}
+
+long get_time_ms() {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
 int check_table(DBCONN* conn, callback_t f) {
 
     char* sql;
@@ -15,22 +15,131 @@
   #define DB_NAME Sensor.db
 #endif
 
+#ifndef DB_PARTITION_NAME
+  #define DB_PARTITION_NAME "Sensor_%d.db" // file of every partition when STRMGR_WRITERS > 1
+#endif
+
 #ifndef TABLE_NAME
   #define TABLE_NAME SensorData
 #endif
 
+#ifndef ROOM_TABLE_NAME
+  #define ROOM_TABLE_NAME SensorRoom
+#endif
+
+#ifndef DB_BATCH_SIZE
+  #define DB_BATCH_SIZE 1000 // rows per transaction before a commit is forced
+#endif
+
+#ifndef DB_FLUSH_MS
+  #define DB_FLUSH_MS 200 // longest time a row may stay uncommitted
+#endif
+
+// storage profiles, chosen at startup with db_set_profile():
+//  "journal" rollback journal, synchronous=FULL (SQLite defaults): every
+//            commit is fsynced before it returns, survives power loss, but
+//            each commit pays two journal fsyncs
+//  "wal"     write-ahead log, synchronous=NORMAL: commits only append to the
+//            WAL and fsync at checkpoints, survives application crashes, a
+//            power loss may roll back the last commits but never corrupts
+//  "fast"    write-ahead log, synchronous=OFF: no fsync at all, survives
+//            application crashes only, an OS crash may corrupt the database
+// both WAL profiles also apply the cache, mmap and page size below and move
+// checkpoints off the writer onto a background thread
+#define DB_PROFILE_JOURNAL 0
+#define DB_PROFILE_WAL 1
+#define DB_PROFILE_FAST 2
+
+#ifndef DB_CACHE_KB
+  #define DB_CACHE_KB 16384 // page cache per connection, memory traded for fewer page reads
+#endif
+
+#ifndef DB_MMAP_SIZE
+  #define DB_MMAP_SIZE 268435456 // bytes read through mmap instead of read(), 0 disables it
+#endif
+
+#ifndef DB_PAGE_SIZE
+  #define DB_PAGE_SIZE 4096 // only takes effect when the database file is created
+#endif
+
+#ifndef DB_BUSY_TIMEOUT_MS
+  #define DB_BUSY_TIMEOUT_MS 5000 // how long a statement waits for a lock held elsewhere before it fails with SQLITE_BUSY
+#endif
+
+// the background checkpoint is passive, it never blocks the writer but under
+// sustained load it cannot start the WAL over either, so the log keeps
+// growing; only past DB_WAL_LIMIT_FRAMES it restarts the log, which holds the
+// writer off until every frame is copied back. A higher limit means fewer
+// writer stalls for a bigger WAL file and slower reads through it
+#ifndef DB_CHECKPOINT_MS
+  #define DB_CHECKPOINT_MS 1000 // interval of the background WAL checkpoint
+#endif
+
+#ifndef DB_WAL_LIMIT_FRAMES
+  #define DB_WAL_LIMIT_FRAMES 16384 // log length in pages past which the checkpointer restarts it
+#endif
+
+#ifndef DB_CHECKPOINT_POLL_US
+  #define DB_CHECKPOINT_POLL_US 50 // how often a restarting checkpoint retries the write lock
+#endif
+
+#ifndef DB_ROLLUP_SLOTS
+  #define DB_ROLLUP_SLOTS 512 // sensor minutes aggregated in memory before they are written out, power of two
+#endif
+
+// when a commit fails, the rolled back rows and every reading after them are
+// appended to a memory-mapped spill journal next to the database file
+// (Sensor.db-spill), so the storage writer keeps draining the buffer; a
+// replayer thread loads the journal into the database in order once it takes
+// writes again and then hands the writer back. The journal is created on the
+// first failed commit and removed once it is empty at shutdown; one left
+// over by an earlier run is replayed at startup
+#ifndef DB_SPILL_SIZE
+  #define DB_SPILL_SIZE (1 << 20) // initial bytes of a spill journal, doubled whenever it fills
+#endif
+
+#ifndef DB_RETRY_MS
+  #define DB_RETRY_MS 1000 // how often the replayer retries a database that refused rows
+#endif
+
+// resolutions of the rollup tables TABLE_NAME_1m, _1h and _1d, which keep
+// count, sum, min and max per sensor and bucket in the same transaction as
+// the raw rows, so aggregate ranges cost one row per bucket
+#define DB_ROLLUP_MINUTE 60
+#define DB_ROLLUP_HOUR 3600
+#define DB_ROLLUP_DAY 86400
+#define DB_ROLLUP_LEVELS 3
+
 #define DBCONN sqlite3
 
 typedef int (*callback_t)(void *, int, char **, char **);
+typedef struct db_writer db_writer_t;
+typedef struct db_checkpointer db_checkpointer_t;
+typedef struct db_cursor db_cursor_t;
 
-void storagemgr_parse_sensor_data(DBCONN * conn, sbuffer_t ** buffer);
-DBCONN * init_connection(char clear_up_flag);
+void storagemgr_parse_sensor_data(DBCONN * conn, sbuffer_t ** buffer, int partition);
+DBCONN * init_connection(char clear_up_flag, int partition);
+DBCONN * connect_partitions();
+int db_set_profile(char * name);
+db_checkpointer_t * checkpointer_start(int partition);
+void checkpointer_stop(db_checkpointer_t ** checkpointer);
 void disconnect(DBCONN *conn);
 int insert_sensor(DBCONN * conn, sensor_id_t id, sensor_value_t value, sensor_ts_t ts);
+db_writer_t * writer_init(DBCONN * conn, int batch_size, int flush_ms);
+int writer_insert(db_writer_t * writer, sensor_data_t * data);
+int writer_flush(db_writer_t * writer);
+int writer_timeout(db_writer_t * writer);
+int writer_free(db_writer_t ** writer);
 int find_sensor_all(DBCONN * conn, callback_t f);
 int find_sensor_by_value(DBCONN * conn, sensor_value_t value, callback_t f);
 int find_sensor_exceed_value(DBCONN * conn, sensor_value_t value, callback_t f);
 int find_sensor_by_timestamp(DBCONN * conn, sensor_ts_t ts, callback_t f);
 int find_sensor_after_timestamp(DBCONN * conn, sensor_ts_t ts, callback_t f);
+db_cursor_t * cursor_by_sensor(DBCONN * conn, sensor_id_t id, sensor_ts_t from, sensor_ts_t to);
+db_cursor_t * cursor_by_time(DBCONN * conn, sensor_ts_t from, sensor_ts_t to);
+int cursor_next(db_cursor_t * cursor, sensor_data_t * data, int max, int * count);
+void cursor_close(db_cursor_t ** cursor);
+int find_rollup_by_sensor(DBCONN * conn, int resolution, sensor_id_t id, sensor_ts_t from, sensor_ts_t to, callback_t f);
+int find_rollup_by_room(DBCONN * conn, int resolution, uint16_t room_id, sensor_ts_t from, sensor_ts_t to, callback_t f);
 
 #endif /* _SENSOR_DB_H_ */